@@ -13,6 +13,10 @@ typedef struct {
 
 int pacman_connect(char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path);
 
+/// Attaches read-only to the running session of another client.
+/// @return 0 if the server accepted the spectator, 1 otherwise.
+int pacman_spectate(char const *notif_pipe_path, char const *server_pipe_path, char const *session_id);
+
 void pacman_play(char command);
 
 /// @return 0 if the disconnection was successful, 1 otherwise.
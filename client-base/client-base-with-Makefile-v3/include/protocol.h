@@ -8,6 +8,7 @@ enum {
   OP_CODE_DISCONNECT = 2,
   OP_CODE_PLAY = 3,
   OP_CODE_BOARD = 4,
+  OP_CODE_SPECTATE = 5,
 };
 
 #endif
\ No newline at end of file
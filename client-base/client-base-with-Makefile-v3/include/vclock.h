@@ -0,0 +1,29 @@
+#ifndef VCLOCK_H
+#define VCLOCK_H
+
+#include <stdint.h>
+
+// Game time source, picked with PACMAN_CLOCK like the server's:
+//   real          wall clock (default)
+//   scaled:<x>    runs x times faster, scaled:100 plays a 100ms tempo every 1ms
+//   manual        time only moves when vclock_advance_ms is called
+// The client only paces its commands and steps the manual clock, so this is the
+// part of the server's vclock it needs, without the interrupts.
+typedef enum {
+    VCLOCK_REAL,
+    VCLOCK_SCALED,
+    VCLOCK_MANUAL,
+} vclock_mode_t;
+
+// Reads PACMAN_CLOCK, returns -1 if it can not be parsed
+int vclock_init();
+
+vclock_mode_t vclock_mode();
+
+// Sleeps for milliseconds of game time
+void vclock_sleep_ms(int milliseconds);
+
+// Manual mode: moves time forward and wakes every sleeper whose deadline passed
+void vclock_advance_ms(uint64_t milliseconds);
+
+#endif
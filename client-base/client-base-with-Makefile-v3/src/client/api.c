@@ -68,6 +68,40 @@ int pacman_connect(char const *req_pipe_path, char const *notif_pipe_path, char
     return 0;
 }
 
+int pacman_spectate(char const *notif_pipe_path, char const *server_pipe_path, char const *session_id) {
+    int fserv;
+    char buffer[BUFFER_SIZE] =  {0};
+
+    // spectators have no request pipe, its slot carries the id of the session to watch
+    buffer[0] = OP_CODE_SPECTATE;
+    strncpy(&buffer[1], session_id, MAX_PIPE_PATH_LENGTH);
+    strncpy(&buffer[41], notif_pipe_path, MAX_PIPE_PATH_LENGTH);
+
+    strncpy(session.notif_pipe_path, notif_pipe_path, MAX_PIPE_PATH_LENGTH);
+
+    unlink(notif_pipe_path);
+
+    if(mkfifo(notif_pipe_path, 0666) == -1){
+      return 1;
+    }
+
+    if ((fserv = open (server_pipe_path,O_WRONLY)) < 0){
+      return 1;
+    }
+
+    write(fserv, buffer, BUFFER_SIZE);
+    close(fserv);
+
+    if ((session.notif_pipe_fd = open (notif_pipe_path,O_RDONLY)) < 0){
+      return 1;
+    }
+
+    char response[2];
+    if (read(session.notif_pipe_fd, response, 2) != 2 || response[1] != 0) return 1;
+
+    return 0;
+}
+
 int pacman_disconnect() {
     char op_code = 2;
 
@@ -79,7 +113,7 @@ int pacman_disconnect() {
         close(session.notif_pipe_fd);
     }
 
-    unlink(session.req_pipe_path);
+    if (session.req_pipe_path[0] != '\0') unlink(session.req_pipe_path);
     unlink(session.notif_pipe_path);
 
     session.req_pipe_fd = -1;
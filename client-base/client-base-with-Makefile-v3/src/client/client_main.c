@@ -2,6 +2,7 @@
 #include "protocol.h"
 #include "display.h"
 #include "debug.h"
+#include "vclock.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,6 +35,8 @@ static void *receiver_thread(void *arg) {
             pthread_mutex_lock(&mutex);
             stop_execution = true;
             pthread_mutex_unlock(&mutex);
+            // wake the input loop if it is waiting for frames that will not come
+            if (vclock_mode() == VCLOCK_MANUAL) vclock_advance_ms(UINT32_MAX);
             break;
         }
 
@@ -41,6 +44,9 @@ static void *receiver_thread(void *arg) {
         tempo = board.tempo;
         pthread_mutex_unlock(&mutex);
 
+        // with a manual clock the client follows the server: every frame is one tempo of game time
+        if (vclock_mode() == VCLOCK_MANUAL) vclock_advance_ms(board.tempo);
+
         draw_board_client(board);
         refresh_screen();
         
@@ -55,9 +61,11 @@ static void *receiver_thread(void *arg) {
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3 && argc != 4) {
+    bool spectate = (argc == 5 && strcmp(argv[3], "--spectate") == 0);
+
+    if (argc != 3 && argc != 4 && !spectate) {
         fprintf(stderr,
-            "Usage: %s <client_id> <register_pipe> [commands_file]\n",
+            "Usage: %s <client_id> <register_pipe> [commands_file | --spectate <session_id>]\n",
             argv[0]);
         return 1;
     }
@@ -65,6 +73,7 @@ int main(int argc, char *argv[]) {
     const char *client_id = argv[1];
     const char *register_pipe = argv[2];
     const char *commands_file = (argc == 4) ? argv[3] : NULL;
+    const char *watched_id = spectate ? argv[4] : NULL;
 
     FILE *cmd_fp = NULL;
     if (commands_file) {
@@ -84,9 +93,19 @@ int main(int argc, char *argv[]) {
     snprintf(notif_pipe_path, MAX_PIPE_PATH_LENGTH,
              "/tmp/%s_notification", client_id);
 
+    if (vclock_init() != 0) {
+        fprintf(stderr, "PACMAN_CLOCK must be real, scaled:<factor> or manual\n");
+        return 1;
+    }
+
     open_debug_file("client-debug.log");
 
-    if (pacman_connect(req_pipe_path, notif_pipe_path, register_pipe) != 0) {
+    if (spectate) {
+        if (pacman_spectate(notif_pipe_path, register_pipe, watched_id) != 0) {
+            debug("Failed to spectate session %s\n", watched_id);
+            return 1;
+        }
+    } else if (pacman_connect(req_pipe_path, notif_pipe_path, register_pipe) != 0) {
         debug("Failed to connect to server\n");
         return 1;
     }
@@ -136,7 +155,7 @@ int main(int argc, char *argv[]) {
             int wait_for = tempo;
             pthread_mutex_unlock(&mutex);
 
-            sleep_ms(wait_for);
+            vclock_sleep_ms(wait_for);
             
         } else {
             // Interactive input
@@ -152,6 +171,10 @@ int main(int argc, char *argv[]) {
             break;
         }
 
+        // spectators only watch, Q is the one key they use
+        if (spectate)
+            continue;
+
         debug("Command: %c\n", command);
 
         pacman_play(command);
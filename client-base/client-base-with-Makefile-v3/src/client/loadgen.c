@@ -0,0 +1,374 @@
+#include "protocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// op code + req_path + notif_path
+#define BUFFER_SIZE 81
+#define HEADER_INTS 6
+#define CLIENT_STACK_SIZE (256 * 1024)
+
+typedef struct {
+    uint32_t *values; // samples in microseconds
+    size_t count;
+    size_t capacity;
+} samples_t;
+
+typedef struct {
+    int index;
+    pthread_t tid;
+    samples_t connect_us;
+    samples_t interval_us;
+    samples_t jitter_us;
+    samples_t input_us;
+    long frames;
+    long commands;
+    long sessions;
+    long errors;
+} client_t;
+
+static const char *register_pipe;
+static char *moves;
+static size_t n_moves;
+static uint64_t deadline_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void samples_add(samples_t *s, uint64_t ns) {
+    if (s->count == s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : 256;
+        s->values = realloc(s->values, s->capacity * sizeof(uint32_t));
+    }
+    uint64_t us = ns / 1000;
+    s->values[s->count++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t) us;
+}
+
+static void samples_merge(samples_t *into, samples_t *from) {
+    for (size_t i = 0; i < from->count; i++) {
+        samples_add(into, (uint64_t) from->values[i] * 1000);
+    }
+    free(from->values);
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int read_all(int fd, void *buffer, size_t len) {
+    size_t done = 0;
+    char *ptr = buffer;
+    while (done < len) {
+        ssize_t ret = read(fd, ptr + done, len - done);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return -1;
+        done += ret;
+    }
+    return 0;
+}
+
+static int load_moves(const char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) return -1;
+
+    size_t capacity = 64;
+    moves = malloc(capacity);
+    int ch;
+    while ((ch = fgetc(fp)) != EOF) {
+        if (ch == '\n' || ch == '\r' || ch == ' ') continue;
+        if (n_moves == capacity) {
+            capacity *= 2;
+            moves = realloc(moves, capacity);
+        }
+        moves[n_moves++] = (char) ch;
+    }
+    fclose(fp);
+    return n_moves > 0 ? 0 : -1;
+}
+
+// Same handshake as pacman_connect, with the connect latency measured around it.
+static int client_connect(client_t *client, const char *req_path, const char *notif_path,
+                          int *req_fd, int *notif_fd) {
+    char buffer[BUFFER_SIZE] = {0};
+    buffer[0] = OP_CODE_CONNECT;
+    strncpy(&buffer[1], req_path, MAX_PIPE_PATH_LENGTH);
+    strncpy(&buffer[41], notif_path, MAX_PIPE_PATH_LENGTH);
+
+    unlink(req_path);
+    unlink(notif_path);
+    if (mkfifo(req_path, 0666) == -1 || mkfifo(notif_path, 0666) == -1) return -1;
+
+    uint64_t start = now_ns();
+
+    int fserv = open(register_pipe, O_WRONLY);
+    if (fserv < 0) return -1;
+    write(fserv, buffer, BUFFER_SIZE);
+    close(fserv);
+
+    if ((*notif_fd = open(notif_path, O_RDONLY)) < 0) return -1;
+    if ((*req_fd = open(req_path, O_WRONLY)) < 0) {
+        close(*notif_fd);
+        return -1;
+    }
+
+    char response[2];
+    if (read_all(*notif_fd, response, 2) != 0 || response[1] != 0) {
+        close(*req_fd);
+        close(*notif_fd);
+        return -1;
+    }
+
+    samples_add(&client->connect_us, now_ns() - start);
+    return 0;
+}
+
+static int find_pacman(const char *map, int size) {
+    const char *c = memchr(map, 'C', size);
+    return c ? (int)(c - map) : -1;
+}
+
+// Plays whole games back to back until the deadline, reconnecting after each one.
+static void *client_thread(void *arg) {
+    client_t *client = arg;
+    char req_path[MAX_PIPE_PATH_LENGTH];
+    char notif_path[MAX_PIPE_PATH_LENGTH];
+    snprintf(req_path, sizeof(req_path), "/tmp/lg%d-%d_request", (int) getpid(), client->index);
+    snprintf(notif_path, sizeof(notif_path), "/tmp/lg%d-%d_notification", (int) getpid(), client->index);
+
+    char *map = NULL;
+    size_t map_capacity = 0;
+    size_t move = (size_t) client->index % n_moves;
+
+    while (now_ns() < deadline_ns) {
+        int req_fd, notif_fd;
+        if (client_connect(client, req_path, notif_path, &req_fd, &notif_fd) != 0) {
+            client->errors++;
+            unlink(req_path);
+            unlink(notif_path);
+            sleep(1);
+            continue;
+        }
+        client->sessions++;
+
+        uint64_t last_frame = 0;
+        uint64_t last_sent = 0;
+        uint64_t pending_input = 0; // send time of a move not yet seen on the board
+        int pending_from = -1;
+
+        while (now_ns() < deadline_ns) {
+            char op_code;
+            int header[HEADER_INTS];
+            if (read_all(notif_fd, &op_code, 1) != 0 || op_code != OP_CODE_BOARD ||
+                read_all(notif_fd, header, sizeof(header)) != 0) {
+                break;
+            }
+
+            size_t size = (size_t) header[0] * header[1];
+            if (size > map_capacity) {
+                map_capacity = size;
+                map = realloc(map, map_capacity);
+            }
+            if (read_all(notif_fd, map, size) != 0) break;
+
+            uint64_t now = now_ns();
+            client->frames++;
+
+            if (last_frame != 0) {
+                uint64_t interval = now - last_frame;
+                uint64_t tempo = (uint64_t) header[2] * 1000000ull;
+                samples_add(&client->interval_us, interval);
+                samples_add(&client->jitter_us, interval > tempo ? interval - tempo : tempo - interval);
+            }
+            last_frame = now;
+
+            int pacman = find_pacman(map, (int) size);
+            if (pending_input != 0 && pacman != pending_from) {
+                samples_add(&client->input_us, now - pending_input);
+                pending_input = 0;
+            }
+
+            if (header[3] || header[4]) break;
+
+            // pace inputs to the level tempo like the replaying client does
+            if (now - last_sent >= (uint64_t) header[2] * 1000000ull) {
+                char command[2] = {OP_CODE_PLAY, moves[move++ % n_moves]};
+                last_sent = now_ns();
+                if (write(req_fd, command, 2) != 2) break;
+                client->commands++;
+                // a move that never shows up (wall) is replaced by the next one
+                pending_input = last_sent;
+                pending_from = pacman;
+            }
+        }
+
+        char op_code = OP_CODE_DISCONNECT;
+        write(req_fd, &op_code, 1);
+        close(req_fd);
+        close(notif_fd);
+        unlink(req_path);
+        unlink(notif_path);
+    }
+
+    free(map);
+    return NULL;
+}
+
+// utime + stime of a process in clock ticks, -1 if it cannot be read
+static long process_cpu_ticks(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    char line[1024];
+    long ticks = -1;
+    if (fgets(line, sizeof(line), fp)) {
+        // fields after the ")" closing the command name start at field 3
+        char *p = strrchr(line, ')');
+        unsigned long utime, stime;
+        if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                        &utime, &stime) == 2) {
+            ticks = (long)(utime + stime);
+        }
+    }
+    fclose(fp);
+    return ticks;
+}
+
+static void report_samples(FILE *out, const char *name, samples_t *s, bool last) {
+    fprintf(out, "  \"%s\": {\"count\": %zu", name, s->count);
+    if (s->count > 0) {
+        qsort(s->values, s->count, sizeof(uint32_t), compare_u32);
+        double sum = 0;
+        for (size_t i = 0; i < s->count; i++) sum += s->values[i];
+        fprintf(out, ", \"mean\": %.1f, \"p50\": %u, \"p90\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u",
+                sum / s->count,
+                s->values[s->count * 50 / 100],
+                s->values[s->count * 90 / 100],
+                s->values[s->count * 99 / 100],
+                s->values[s->count * 999 / 1000],
+                s->values[s->count - 1]);
+    }
+    fprintf(out, "}%s\n", last ? "" : ",");
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s -r <register_pipe> [-n clients] [-d seconds] [-m moves_file] "
+        "[-p server_pid] [-o report.json]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    int n_clients = 100;
+    int duration = 10;
+    int server_pid = 0;
+    const char *moves_file = "moves/1.p";
+    const char *report_file = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:n:d:m:p:o:")) != -1) {
+        switch (opt) {
+            case 'r': register_pipe = optarg; break;
+            case 'n': n_clients = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'm': moves_file = optarg; break;
+            case 'p': server_pid = atoi(optarg); break;
+            case 'o': report_file = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (!register_pipe || n_clients <= 0 || duration <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (load_moves(moves_file) != 0) {
+        fprintf(stderr, "Failed to read moves from %s\n", moves_file);
+        return 1;
+    }
+
+    // sessions the server ends while we still write to them show up as write errors
+    signal(SIGPIPE, SIG_IGN);
+
+    client_t *clients = calloc(n_clients, sizeof(client_t));
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CLIENT_STACK_SIZE);
+
+    long cpu_start = server_pid ? process_cpu_ticks(server_pid) : -1;
+    uint64_t start = now_ns();
+    deadline_ns = start + (uint64_t) duration * 1000000000ull;
+
+    int started = 0;
+    for (int i = 0; i < n_clients; i++) {
+        clients[i].index = i;
+        if (pthread_create(&clients[i].tid, &attr, client_thread, &clients[i]) != 0) break;
+        started++;
+    }
+    pthread_attr_destroy(&attr);
+
+    for (int i = 0; i < started; i++) pthread_join(clients[i].tid, NULL);
+
+    double elapsed = (now_ns() - start) / 1e9;
+    long cpu_end = server_pid ? process_cpu_ticks(server_pid) : -1;
+
+    client_t total = {0};
+    for (int i = 0; i < started; i++) {
+        samples_merge(&total.connect_us, &clients[i].connect_us);
+        samples_merge(&total.interval_us, &clients[i].interval_us);
+        samples_merge(&total.jitter_us, &clients[i].jitter_us);
+        samples_merge(&total.input_us, &clients[i].input_us);
+        total.frames += clients[i].frames;
+        total.commands += clients[i].commands;
+        total.sessions += clients[i].sessions;
+        total.errors += clients[i].errors;
+    }
+
+    FILE *out = report_file ? fopen(report_file, "w") : stdout;
+    if (!out) {
+        perror("Failed to open report file");
+        out = stdout;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"clients\": %d,\n  \"duration_s\": %.3f,\n", started, elapsed);
+    fprintf(out, "  \"sessions\": %ld,\n  \"connect_errors\": %ld,\n", total.sessions, total.errors);
+    fprintf(out, "  \"frames\": %ld,\n  \"frames_per_s\": %.1f,\n", total.frames, total.frames / elapsed);
+    fprintf(out, "  \"commands\": %ld,\n", total.commands);
+    if (cpu_start >= 0 && cpu_end >= 0) {
+        fprintf(out, "  \"server_cpu_pct\": %.1f,\n",
+                100.0 * (cpu_end - cpu_start) / sysconf(_SC_CLK_TCK) / elapsed);
+    }
+    report_samples(out, "connect_latency_us", &total.connect_us, false);
+    report_samples(out, "frame_interval_us", &total.interval_us, false);
+    report_samples(out, "frame_jitter_us", &total.jitter_us, false);
+    report_samples(out, "input_to_frame_us", &total.input_us, true);
+    fprintf(out, "}\n");
+
+    if (out != stdout) fclose(out);
+
+    free(total.connect_us.values);
+    free(total.interval_us.values);
+    free(total.jitter_us.values);
+    free(total.input_us.values);
+    free(clients);
+    free(moves);
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include "vclock.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <stdbool.h>
+
+static vclock_mode_t mode = VCLOCK_REAL;
+static double scale = 1.0;
+
+// Manual mode is a discrete event clock: vclock_advance_ms jumps to the next deadline,
+// wakes those sleepers and waits for them to sleep again (or exit) before the next jump,
+// so advancing 100ms ticks a 10ms thread ten times.
+#define VCLOCK_QUIET_WAIT_MS 50
+
+typedef struct sleeper {
+    uint64_t deadline;
+    int woken;
+    struct sleeper *next;
+} sleeper_t;
+
+static uint64_t manual_now_ms = 0;
+static sleeper_t *sleepers = NULL;
+static int awake = 0; // woken by an advance and not sleeping again yet
+static pthread_mutex_t manual_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t manual_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t quiet_cond = PTHREAD_COND_INITIALIZER;
+// set while the thread is counted in awake
+static pthread_key_t awake_key;
+
+static void real_sleep_ns(uint64_t ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+static void back_to_sleep() {
+    if (!pthread_getspecific(awake_key)) return;
+    pthread_setspecific(awake_key, NULL);
+    if (--awake == 0) pthread_cond_broadcast(&quiet_cond);
+}
+
+// a woken thread that exits without sleeping again must not hold the clock
+static void awake_thread_exit(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&manual_mutex);
+    if (--awake == 0) pthread_cond_broadcast(&quiet_cond);
+    pthread_mutex_unlock(&manual_mutex);
+}
+
+static void manual_sleep(int milliseconds) {
+    pthread_mutex_lock(&manual_mutex);
+    back_to_sleep();
+
+    sleeper_t me = {manual_now_ms + milliseconds, 0, sleepers};
+    sleepers = &me;
+    while (!me.woken) {
+        pthread_cond_wait(&manual_cond, &manual_mutex);
+    }
+    // the advancing thread already unlinked me and counted me in awake
+    pthread_setspecific(awake_key, &me);
+    pthread_mutex_unlock(&manual_mutex);
+}
+
+int vclock_init() {
+    pthread_key_create(&awake_key, awake_thread_exit);
+
+    char *value = getenv("PACMAN_CLOCK");
+    if (!value || strcmp(value, "real") == 0) {
+        mode = VCLOCK_REAL;
+    } else if (strcmp(value, "manual") == 0) {
+        mode = VCLOCK_MANUAL;
+    } else if (strncmp(value, "scaled:", 7) == 0 && atof(value + 7) > 0) {
+        mode = VCLOCK_SCALED;
+        scale = atof(value + 7);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+vclock_mode_t vclock_mode() {
+    return mode;
+}
+
+void vclock_sleep_ms(int milliseconds) {
+    if (milliseconds <= 0) return;
+
+    switch (mode) {
+        case VCLOCK_MANUAL:
+            manual_sleep(milliseconds);
+            break;
+        case VCLOCK_SCALED:
+            real_sleep_ns((uint64_t) (milliseconds * 1000000.0 / scale));
+            break;
+        default:
+            real_sleep_ns((uint64_t) milliseconds * 1000000);
+            break;
+    }
+}
+
+void vclock_advance_ms(uint64_t milliseconds) {
+    pthread_mutex_lock(&manual_mutex);
+    uint64_t target = manual_now_ms + milliseconds;
+
+    while (true) {
+        // let the threads woken by the previous step run, but never hang on one that blocks elsewhere
+        struct timespec limit;
+        clock_gettime(CLOCK_REALTIME, &limit);
+        limit.tv_nsec += VCLOCK_QUIET_WAIT_MS * 1000000L;
+        limit.tv_sec += limit.tv_nsec / 1000000000L;
+        limit.tv_nsec %= 1000000000L;
+        while (awake > 0) {
+            if (pthread_cond_timedwait(&quiet_cond, &manual_mutex, &limit) == ETIMEDOUT) break;
+        }
+
+        uint64_t next = target;
+        for (sleeper_t *s = sleepers; s; s = s->next) {
+            if (s->deadline < next) next = s->deadline;
+        }
+        if (next > manual_now_ms) manual_now_ms = next;
+
+        int woken = 0;
+        for (sleeper_t **s = &sleepers; *s; ) {
+            if ((*s)->deadline <= manual_now_ms) {
+                (*s)->woken = 1;
+                *s = (*s)->next;
+                woken++;
+            } else {
+                s = &(*s)->next;
+            }
+        }
+        awake += woken;
+        if (woken) pthread_cond_broadcast(&manual_cond);
+        if (manual_now_ms >= target && !woken) break;
+    }
+    pthread_mutex_unlock(&manual_mutex);
+}
@@ -1,12 +1,14 @@
 #ifndef BOARD_H
 #define BOARD_H
 
-#define MAX_MOVES 20
 #define MAX_LEVELS 20
 #define MAX_FILENAME 256
 #define MAX_GHOSTS 25
 
 #include <pthread.h>
+#include <stdint.h>
+#include "log.h"
+#include "lockprof.h"
 
 typedef enum {
     REACHED_PORTAL = 1,
@@ -18,40 +20,56 @@ typedef enum {
 typedef struct {
     char command;
     int turns;
-    int turns_left;
 } command_t;
 
+// A compiled .p/.m file, never written once compiled, see script.h
+typedef struct {
+    int n_ops;
+    command_t ops[];
+} script_t;
+
+#define SCRIPT_MAX_DEPTH 16 // REPEATs inside REPEATs
+
+// Where an entity is in the REPEATs of its script, plain data like the rest of it
+typedef struct {
+    int depth; // open loops
+    int left[SCRIPT_MAX_DEPTH]; // rounds still to play of each, the innermost last
+} script_loops_t;
+
 typedef struct {
     int pos_x, pos_y; //current position
     int alive; // if is alive
     int points; // how many points have been collected
     int passo; // number of plays to wait before starting
-    command_t moves[MAX_MOVES];
-    int current_move;
-    int n_moves;
+    const script_t *script; // NULL when the client or the keyboard plays it
+    int pc; // next op of the script
+    script_loops_t loops;
+    int turns_left; // of the T being played, 0 when none is
     int waiting;
 } pacman_t;
 
 typedef struct {
     int pos_x, pos_y; //current position
     int passo; // number of plays to wait before starting
-    command_t moves[MAX_MOVES];
-    int n_moves;
-    int current_move;
+    const script_t *script;
+    int pc;
+    script_loops_t loops;
+    int turns_left;
     int waiting;
     int charged;
 } ghost_t;
 
+// Plain data so a whole board can be copied with memcpy, the cell locks live in board_t
 typedef struct {
     char content; // stuff like 'P' for pacman 'M' for monster and 'W' for wall
-    int has_dot; // whether there is a dot in this position or not
-    int has_portal; // whether there is a portal in this position or not
-    pthread_mutex_t lock;
+    char has_dot; // whether there is a dot in this position or not
+    char has_portal; // whether there is a portal in this position or not
 } board_pos_t;
 
 typedef struct {
     int width, height; //dimensions of the board
     board_pos_t* board; //actual board, most likely a row-major matrix
+    pthread_mutex_t* locks; // one per cell, same indexes as board
     int n_pacmans; //number of pacmans in the board
     pacman_t* pacmans; // array containing every pacman in the board to iterate through when processing
     int n_ghosts; //number of ghosts in the board
@@ -62,14 +80,26 @@ typedef struct {
     int tempo; // Duracao de cada jogada???
     pthread_rwlock_t state_lock;
     int thread_shutdown;
+    lock_heat_t *lock_heat; // only allocated by the LOCK_PROFILE build
+    char *image; // mapped .lvlb the arrays above point into, NULL for a parsed level
+    size_t image_size;
+    int own_pacmans; // pacmans were moved out of the image by spawn_pacmans
+    // Steps from every cell to the closest pacman, -1 for walls and cells that can't reach one.
+    // Allocated with the level when a ghost script hunts ('H'). Built by the first hunting
+    // ghost that finds a pacman moved, the others just read it
+    int *flow;
+    int *flow_queue;
+    uint64_t flow_key; // where the pacmans were when it was built, 0 for never
+    pthread_mutex_t flow_lock;
 } board_t;
 
 /*Move pacman/monster in a certain direction on the board must check for boundaries, walls and other monsters
 Maybe do 1 function for pacman and 1 for monsters if required
 Maybe do 1 function for each direction
 */
-int move_pacman(board_t* board, int pacman_index, command_t* command);
-int move_ghost(board_t* board, int ghost_index, command_t* command);
+int move_pacman(board_t* board, int pacman_index, const command_t* command);
+int move_ghost(board_t* board, int ghost_index, const command_t* command);
+int move_ghost_charged(board_t* board, int ghost_index, char direction);
 
 /*Remove an object (Pacman)*/
 void kill_pacman(board_t* board, int pacman_index);
@@ -85,19 +115,61 @@ int load_ghost(board_t* board);
 Fils the board with the information coming from the file
 */
 int load_level(board_t* board, char* filename, char* dirname, int accumulated_points);
-// Unloads levels loaded by load_level
+// Unloads levels loaded by load_level or clone_level
 void unload_level(board_t * board);
 
-// DEBUG FILE
+// Only the cells, entities and scripts, without the locks playing needs.
+// Fails for a level with a ghost that has no moves
+int load_level_data(board_t* board, char* filename, char* dirname, int accumulated_points);
+void unload_level_data(board_t* board);
+
+// A playable copy of a level read by load_level_data, it keeps no pointer into it
+// except the compiled scripts, which are never written
+int clone_level(board_t* board, const board_t* level, int accumulated_points);
+
+#ifdef LOCK_PROFILE
+// Adds the cell contention of a board being unloaded to its level's totals,
+// lockprof_report writes them to lockprof_<level>.txt
+void lockprof_collect_heatmap(board_t *board);
+#endif
 
-void open_debug_file(char *filename);
+/*
+Grows the level to n pacmans for a room, the new ones are played by clients and
+start on free cells spread over the board. Pacman 0 keeps its place and script.
+Returns -1 if the board has no room for them.
+*/
+int spawn_pacmans(board_t* board, int n);
 
-void close_debug_file();
+/*
+Copy of everything a level changes while it is played: the cells, the pacmans and
+the ghosts with their script counters. Buffers are allocated once per level, so saving
+and restoring are plain memcpys. Callers must keep the movers out (state_lock).
+*/
+typedef struct {
+    board_pos_t* board;
+    pacman_t* pacmans;
+    ghost_t* ghosts;
+    int saved; // a restore consumes the checkpoint, like the old forked backup
+} board_checkpoint_t;
+
+int checkpoint_init(board_checkpoint_t* checkpoint, board_t* board);
+void checkpoint_save(board_checkpoint_t* checkpoint, board_t* board);
+// Returns -1 if there is nothing saved
+int checkpoint_restore(board_checkpoint_t* checkpoint, board_t* board);
+void checkpoint_free(board_checkpoint_t* checkpoint);
 
-void debug(const char * format, ...);
+// DEBUG FILE, see log.h
 
 void print_board(board_t* board);
 
+/*Writes the width*height characters a client draws into output*/
+void board_to_string(board_t* board, char* output);
+// Only rows first_row up to end_row, at the same place of output board_to_string puts them
+void board_to_string_rows(board_t* board, char* output, int first_row, int end_row);
+
 void sleep_ms(int milliseconds);
 
+// CLOCK_MONOTONIC in nanoseconds, for measuring latencies
+uint64_t monotonic_ns();
+
 #endif
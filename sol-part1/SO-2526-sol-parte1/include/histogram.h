@@ -0,0 +1,34 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+Log-linear (HDR style) histogram of nanosecond values.
+Every power of two is split in HIST_SUB_BUCKETS linear buckets, so any
+recorded value is reported within ~3% of its real value.
+Recording is a couple of relaxed atomic adds and never takes a lock.
+*/
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    atomic_uint_fast64_t counts[HIST_BUCKETS];
+    atomic_uint_fast64_t total;
+    atomic_uint_fast64_t max;
+} histogram_t;
+
+void histogram_init(histogram_t *hist);
+
+void histogram_record(histogram_t *hist, uint64_t value);
+
+uint64_t histogram_count(histogram_t *hist);
+
+uint64_t histogram_max(histogram_t *hist);
+
+/*Smallest value such that percentile% of the samples are at or below it, 0 if empty*/
+uint64_t histogram_percentile(histogram_t *hist, double percentile);
+
+#endif
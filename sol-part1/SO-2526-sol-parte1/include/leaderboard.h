@@ -0,0 +1,33 @@
+#ifndef LEADERBOARD_H
+#define LEADERBOARD_H
+
+#define LEADERBOARD_TOP 5
+#define LEADERBOARD_ID_LENGTH 40
+
+/*
+Scores of the active sessions kept sorted as they change, so the top
+LEADERBOARD_TOP is always the head of the ranking. A score change moves its
+entry by the few positions it overtook. Every call takes one mutex.
+Entries are addressed by slot, the session's index in active_sessions.
+*/
+
+typedef struct {
+    char id[LEADERBOARD_ID_LENGTH];
+    int score;
+} leaderboard_entry_t;
+
+int leaderboard_init(int slots);
+
+// Adds the slot if it is not ranked yet
+void leaderboard_update(int slot, const char *id, int score);
+
+void leaderboard_remove(int slot);
+
+// Copies up to max best entries, highest score first
+int leaderboard_top(leaderboard_entry_t *out, int max);
+
+// Writes the top entries to filename.tmp and renames it over filename,
+// readers see either the old or the new file
+int leaderboard_publish(const char *filename);
+
+#endif
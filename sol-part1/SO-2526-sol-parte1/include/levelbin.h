@@ -0,0 +1,29 @@
+#ifndef LEVELBIN_H
+#define LEVELBIN_H
+
+#include "board.h"
+
+/*
+Compiled levels. levelc turns a .lvl and the .p/.m files it names into one
+<level>.lvlb image holding the cells, the pacmans and the ghosts exactly as
+board_t keeps them, scripts included. load_level maps the image copy-on-write
+and points the board at it, so nothing is parsed and every session playing the
+level shares the pages it hasn't written to. The image records the mtime (to
+the nanosecond) and size of the .lvl and of every .p/.m it was built from; once
+any of them differs, or the image was made by a build with a different
+LEVELBIN_VERSION or struct layout, it is ignored and the text files are parsed
+instead until levelc runs again.
+*/
+
+#define LEVELBIN_VERSION 3
+
+// Parses the text files and writes the image to output, replaced atomically
+int levelbin_compile(char *filename, char *dirname, const char *output);
+
+// Maps <dirname>/<filename>b, returns -1 if it is missing, stale or invalid
+int levelbin_load(board_t *board, char *filename, char *dirname, int points);
+
+// Unmaps the image of a board loaded by levelbin_load
+void levelbin_unload(board_t *board);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef LEVELINDEX_H
+#define LEVELINDEX_H
+
+#include "board.h"
+#include <stdatomic.h>
+
+/*
+The levels a session plays, in name order. Built once at startup from every .lvl
+of the directory that loads, and rebuilt by an inotify thread when a .lvl, .lvlb,
+.m or .p is added, changed or removed. A rebuild publishes a new index, sessions
+hold a reference to the one they started with until they end. Every level is
+read and checked once per index and sessions play copies of it (clone_level),
+so an edit only reaches the sessions that start after the next rebuild.
+*/
+
+typedef struct {
+    atomic_int refs;
+    int n_levels;
+    char (*names)[MAX_FILENAME]; // .lvl file names
+    board_t *levels; // what they held when indexed, see load_level_data
+} levelindex_t;
+
+// Builds the first index and starts the watch, returns -1 if the directory can't be read
+int levelindex_init(char *dirname);
+
+// The current index, keep it until levelindex_release
+levelindex_t* levelindex_acquire();
+void levelindex_release(levelindex_t *index);
+
+// Position of the level load_level names level_name, -1 if it isn't there
+int levelindex_find(levelindex_t *index, const char *level_name);
+
+#endif
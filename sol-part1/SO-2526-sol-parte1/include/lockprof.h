@@ -0,0 +1,51 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// Lock classes counted separately by the LOCK_PROFILE build (make LOCKPROF=1)
+typedef enum {
+    LOCK_CELL,    // the two cells locked by move_pacman/move_ghost
+    LOCK_CHARGE,  // the row/column range locked by move_ghost_charged
+    LOCK_STATE,   // board state_lock, read or write
+    LOCK_SESSION, // session_mutex
+    LOCK_CLASS_COUNT
+} lock_class_t;
+
+// Per-cell contention, one entry for each board cell
+typedef struct {
+    uint64_t contended;
+    uint64_t wait_ns;
+} lock_heat_t;
+
+#ifdef LOCK_PROFILE
+
+int lockprof_mutex_lock(pthread_mutex_t *lock, lock_class_t lock_class, lock_heat_t *heat, int idx);
+int lockprof_rdlock(pthread_rwlock_t *lock);
+int lockprof_wrlock(pthread_rwlock_t *lock);
+
+// Writes the contention per class to filename, and the heat map of every level
+// played so far to lockprof_<level>.txt, each replaced with the new totals
+void lockprof_report(const char *filename);
+// lockprof_collect_heatmap is declared in board.h
+
+#define cell_lock(board, idx) lockprof_mutex_lock(&(board)->locks[idx], LOCK_CELL, (board)->lock_heat, idx)
+#define charge_lock(board, idx) lockprof_mutex_lock(&(board)->locks[idx], LOCK_CHARGE, (board)->lock_heat, idx)
+#define state_rdlock(lock) lockprof_rdlock(lock)
+#define state_wrlock(lock) lockprof_wrlock(lock)
+#define session_lock(lock) lockprof_mutex_lock(lock, LOCK_SESSION, NULL, 0)
+
+#else
+
+static inline void lockprof_report(const char *filename) { (void) filename; }
+
+#define cell_lock(board, idx) pthread_mutex_lock(&(board)->locks[idx])
+#define charge_lock(board, idx) pthread_mutex_lock(&(board)->locks[idx])
+#define state_rdlock(lock) pthread_rwlock_rdlock(lock)
+#define state_wrlock(lock) pthread_rwlock_wrlock(lock)
+#define session_lock(lock) pthread_mutex_lock(lock)
+
+#endif
+
+#endif
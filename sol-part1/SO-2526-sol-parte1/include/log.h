@@ -0,0 +1,45 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+// Log levels, lower is more important
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+// Messages above LOG_LEVEL are compiled out: make LOG_LEVEL=LOG_INFO
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_DEBUG
+#endif
+
+// Longest message kept, print_board builds up to 8KB
+#define LOG_MAX_MESSAGE 8192
+
+// Runtime threshold, starts at LOG_LEVEL and can be lowered with PACMAN_LOG_LEVEL
+extern int log_runtime_level;
+
+#define log_at(level, ...) do { \
+    if ((level) <= LOG_LEVEL && (level) <= log_runtime_level) log_write(__VA_ARGS__); \
+} while (0)
+
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO, __VA_ARGS__)
+#define debug(...)     log_at(LOG_DEBUG, __VA_ARGS__)
+
+/*Copies the formatted message into the calling thread's ring, never blocks.
+  Drops the message if the ring is full.*/
+void log_write(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// Starts the writer thread that drains every ring into filename
+void open_debug_file(char *filename);
+
+// Drains what is left and stops the writer thread
+void close_debug_file();
+
+// Messages lost because a ring was full or no ring was free
+uint64_t log_dropped();
+
+#endif
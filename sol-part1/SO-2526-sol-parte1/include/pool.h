@@ -0,0 +1,29 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/*
+Size-classed free lists for level storage (cells, locks, entities, checkpoints).
+Each session worker owns a pool and every thread working for it calls pool_use;
+blocks go back to the free list of their class instead of to the system
+allocator, so after the first levels a worker allocates nothing and its memory
+stays at the peak it needed. Threads with no pool (tools, the level index) get
+plain calloc/free through the same calls.
+*/
+
+typedef struct pool pool_t;
+
+pool_t* pool_create();
+
+// Pool the calling thread allocates from, NULL for the system allocator
+void pool_use(pool_t *pool);
+pool_t* pool_current();
+
+// Zeroed like calloc
+void* pool_calloc(size_t count, size_t size);
+
+// Returns the block to the pool it came from
+void pool_free(void *ptr);
+
+#endif
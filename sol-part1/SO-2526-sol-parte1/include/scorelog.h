@@ -0,0 +1,44 @@
+#ifndef SCORELOG_H
+#define SCORELOG_H
+
+#include <stdint.h>
+
+/*
+All-time scores. Every finished session is appended to <prefix>.log as one
+fixed size record and inserted in skip lists ordered by score, one for all
+time and one per final level, so inserts are O(log n) and a top-N is a walk
+of N nodes. A background thread compacts the log into <prefix>.snap, keeping
+only the records that can still show up in a top SCORELOG_KEEP, and startup
+loads the snapshot plus whatever the log has after it.
+*/
+
+#define SCORELOG_ID_LENGTH 40
+#define SCORELOG_LEVEL_LENGTH 64
+#define SCORELOG_KEEP 100 // best records kept per list by compaction
+#define SCORELOG_COMPACT_EVERY 1024 // appended records that trigger a compaction
+
+typedef struct {
+    uint64_t seq;
+    char id[SCORELOG_ID_LENGTH];
+    char level[SCORELOG_LEVEL_LENGTH]; // level the session ended on
+    int32_t score;
+    int32_t levels_cleared;
+    uint64_t duration_ms;
+    uint32_t checksum; // of every byte before it, torn records are skipped on load
+} score_record_t;
+
+// Loads <prefix>.snap and <prefix>.log and starts the compaction thread
+int scorelog_open(const char *prefix);
+
+void scorelog_append(const char *id, const char *level, int score, int levels_cleared, uint64_t duration_ms);
+
+// Best n records of all time (level NULL) or of sessions that ended on level
+int scorelog_top(const char *level, score_record_t *out, int n);
+
+// Writes the all-time and per-level top 5 to filename, replaced atomically
+int scorelog_publish(const char *filename);
+
+// Compacts one last time and stops the compaction thread
+void scorelog_close();
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include "board.h"
+#include <stdbool.h>
+
+/*
+Movement scripts (.p and .m files) compiled to a flat array of command_t.
+Besides one command per line (W A S D R, C and H for ghosts, G Q for the pacman)
+and "T n", a block between "REPEAT n" and "END" is played n times. A block
+compiles to a '[' op holding n, its body, and a ']' op holding the index of
+its '['; blocks nest up to SCRIPT_MAX_DEPTH deep. The entity keeps the rounds
+left of each open block in its script_loops_t, so a script is as long as its
+file whatever the counts are. Compiled scripts are cached by file and shared
+by every board loading them, until the file changes.
+*/
+
+#define SCRIPT_MAX_OPS (1 << 20)
+
+typedef enum {
+    SCRIPT_PACMAN,
+    SCRIPT_GHOST,
+} script_kind_t;
+
+// NULL if the file can't be read or has no moves
+const script_t* script_acquire(const char *path, script_kind_t kind);
+void script_release(const script_t *script);
+// One more board plays a script it got from another, a script that isn't
+// cached (it lives in a .lvlb image) is left alone like in script_release
+void script_retain(const script_t *script);
+
+// Bytes of the script header and its ops, what a .lvlb stores
+size_t script_size(int n_ops);
+
+// Whether the loops of a script that wasn't compiled here (a .lvlb) are well formed
+bool script_valid(const script_t *script);
+
+// The move the entity plays now. Steps pc and loops over the loop ops, and
+// back to the start once the script ends
+const command_t* script_next(const script_t *script, int *pc, script_loops_t *loops);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+/*
+Splits board-wide work (encoding a frame of a huge board) in shards played by
+a small pool of threads. The caller plays shard 0 itself and shard_run returns
+once every shard is done, so the work is only split, never queued. A session
+worker keeps its pool across levels like its entity threads.
+*/
+
+#define MAX_SHARDS 16
+
+typedef struct shard_pool shard_pool_t;
+
+// Shard number shard of n_shards
+typedef void (*shard_fn_t)(void *arg, int shard, int n_shards);
+
+// n_shards - 1 threads, NULL if none could be created
+shard_pool_t* shard_pool_create(int n_shards);
+void shard_pool_destroy(shard_pool_t *pool);
+
+int shard_pool_size(shard_pool_t *pool);
+
+void shard_run(shard_pool_t *pool, shard_fn_t fn, void *arg);
+
+#endif
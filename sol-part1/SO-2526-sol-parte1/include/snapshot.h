@@ -0,0 +1,51 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "board.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Crash recovery. With PACMAN_SNAPSHOT_EVERY=<ticks> every session keeps its level
+state in <PACMAN_SNAPSHOT_DIR>/<id>.snap (default dir "snapshots"), a file mapped
+in memory with two slots. A save writes the older slot: its seq is zeroed first,
+then the cells, pacmans and ghosts, the checksum and finally the new seq, so a
+crash in the middle leaves the other slot as the newest valid one. A session
+that ends normally removes its file, after a server crash the client reconnecting
+with the same id picks up on the level and tick it was on.
+*/
+
+typedef struct {
+    char *map; // NULL until a level is started
+    size_t size;
+    uint64_t seq;
+    int levels_cleared;
+    char *pending; // newest slot found by snapshot_pending
+    char path[MAX_FILENAME];
+} snapshot_t;
+
+// Reads the environment, returns -1 if the snapshot directory can't be created
+int snapshot_init();
+
+// Ticks between saves, 0 when snapshots are off
+int snapshot_every();
+
+// NULL when snapshots are off
+snapshot_t* snapshot_open(const char *id);
+
+// Level and progress of a snapshot left behind by a crash, -1 if there is none
+int snapshot_pending(snapshot_t *snapshot, char *level, size_t level_size, int *levels_cleared);
+
+// Puts the saved cells and entities back on a board freshly loaded with load_level
+int snapshot_restore(snapshot_t *snapshot, board_t *board);
+
+// Maps a new file sized for this level and saves its first state, replaced atomically
+int snapshot_begin_level(snapshot_t *snapshot, board_t *board, int levels_cleared);
+
+// Callers must keep the movers out (state_lock)
+void snapshot_save(snapshot_t *snapshot, board_t *board);
+
+// Unmaps the file, removing it when the session is over
+void snapshot_close(snapshot_t *snapshot, int discard);
+
+#endif
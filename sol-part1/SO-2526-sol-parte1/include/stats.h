@@ -0,0 +1,39 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+Server wide counters.
+Every thread adds into its own cache line (one stripe per thread, handed out
+round robin) so hot paths never share a counter; a snapshot sums the stripes.
+*/
+typedef enum {
+    STAT_SESSIONS_STARTED,
+    STAT_SESSIONS_ENDED,
+    STAT_SESSIONS_QUEUED,
+    STAT_SESSIONS_DEQUEUED,
+    STAT_FRAMES_SENT,
+    STAT_BYTES_WRITTEN,
+    STAT_COMMANDS_RECEIVED,
+    STAT_PACMAN_TICKS,
+    STAT_GHOST_TICKS,
+    STAT_SLOT_WAITS,
+    STAT_SLOT_WAIT_NS,
+    STAT_LEVEL_LOADS,
+    STAT_SESSIONS_RESUMED,
+    STAT_LEVEL_INDEX_RELOADS,
+    STAT_ENTITY_THREADS_SPAWNED,
+    STAT_CHECKPOINT_RESTORES,
+    STAT_COUNT
+} stat_t;
+
+void stats_add(stat_t stat, uint64_t value);
+
+uint64_t stats_get(stat_t stat);
+
+/*Writes every counter in the Prometheus text format*/
+void stats_write(FILE *out);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Chrome trace-event export, enabled with PACMAN_TRACE=<file.json>.
+// Open the file in chrome://tracing or ui.perfetto.dev
+// Events are kept in memory and the file is written on SIGUSR1, on SIGTERM or
+// SIGINT before the server stops, and when it returns from main
+
+#define TRACE_TAG_LENGTH 40
+
+extern int trace_enabled;
+
+// Reads PACMAN_TRACE and registers the exit flush
+void trace_init();
+
+// Names the calling thread in the trace viewer
+void trace_thread_name(const char *name);
+
+// Start of a span, 0 when tracing is off
+uint64_t trace_begin();
+
+// Records a complete span started at start, tagged with a session id
+void trace_end(const char *name, const char *session, uint64_t start);
+
+// Rewrites the trace file with every event recorded so far
+void trace_flush();
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef VCLOCK_H
+#define VCLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Game time source, picked with PACMAN_CLOCK:
+//   real          wall clock (default)
+//   scaled:<x>    runs x times faster, scaled:100 plays a 100ms tempo every 1ms
+//   manual        time only moves when vclock_advance_ms is called
+typedef enum {
+    VCLOCK_REAL,
+    VCLOCK_SCALED,
+    VCLOCK_MANUAL,
+} vclock_mode_t;
+
+// Reads PACMAN_CLOCK, returns -1 if it can not be parsed
+int vclock_init();
+
+vclock_mode_t vclock_mode();
+
+// Game time in milliseconds since vclock_init
+uint64_t vclock_now_ms();
+
+// Sleeps for milliseconds of game time
+void vclock_sleep_ms(int milliseconds);
+
+// Wakes every thread sleeping on it at once, and makes later sleeps on it return
+// right away until it is reset
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool interrupted;
+} vclock_interrupt_t;
+
+void vclock_interrupt_init(vclock_interrupt_t *interrupt);
+void vclock_interrupt_reset(vclock_interrupt_t *interrupt);
+void vclock_interrupt(vclock_interrupt_t *interrupt);
+
+// Like vclock_sleep_ms, returns true if it was cut short by vclock_interrupt
+bool vclock_sleep_interruptible_ms(int milliseconds, vclock_interrupt_t *interrupt);
+
+// Manual mode: the calling thread waits on something other than the clock until its
+// next sleep, like a thread parked between levels, so advances don't wait for it
+void vclock_idle();
+
+// Manual mode: moves time forward and wakes every sleeper whose deadline passed
+void vclock_advance_ms(uint64_t milliseconds);
+
+#endif
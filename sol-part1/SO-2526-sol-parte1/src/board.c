@@ -1,15 +1,16 @@
 #include "board.h"
 #include "parser.h"
+#include "levelbin.h"
+#include "pool.h"
+#include "script.h"
 #include <stdlib.h>
 #include <stdio.h> //snprintf
+#include <string.h>
 #include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
-#include <stdarg.h>
 #include <pthread.h>
 
-FILE * debugfile;
-
 // Helper private function to find and kill pacman at specific position
 static int find_and_kill_pacman(board_t* board, int new_x, int new_y) {
     for (int p = 0; p < board->n_pacmans; p++) {
@@ -40,7 +41,13 @@ void sleep_ms(int milliseconds) {
     nanosleep(&ts, NULL);
 }
 
-int move_pacman(board_t* board, int pacman_index, command_t* command) {
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int move_pacman(board_t* board, int pacman_index, const command_t* command) {
     if (pacman_index < 0 || !board->pacmans[pacman_index].alive) {
         return DEAD_PACMAN; // Invalid or dead pacman
     }
@@ -78,18 +85,15 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
             new_x++;
             break;
         case 'T': // Wait
-            if (command->turns_left == 1) {
-                pac->current_move += 1; // move on
-                command->turns_left = command->turns;
-            }
-            else command->turns_left -= 1;
+            if (pac->turns_left == 0) pac->turns_left = command->turns;
+            if (--pac->turns_left == 0) pac->pc += 1; // move on
             return VALID_MOVE;
         default:
             return INVALID_MOVE; // Invalid direction
     }
 
     // Logic for the WASD movement
-    pac->current_move+=1;
+    pac->pc += 1;
 
     // Check boundaries
     if (!is_valid_position(board, new_x, new_y)) {
@@ -101,12 +105,12 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
 
     // locks
     if (old_index < new_index) {
-        pthread_mutex_lock(&board->board[old_index].lock);
-        pthread_mutex_lock(&board->board[new_index].lock);
+        cell_lock(board, old_index);
+        cell_lock(board, new_index);
     }
     else {
-        pthread_mutex_lock(&board->board[new_index].lock);
-        pthread_mutex_lock(&board->board[old_index].lock);
+        cell_lock(board, new_index);
+        cell_lock(board, old_index);
     }
 
     char target_content = board->board[new_index].content;
@@ -117,8 +121,8 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
         return REACHED_PORTAL;
     }
 
-    // Check for walls
-    if (target_content == 'W') {
+    // Check for walls and other players
+    if (target_content == 'W' || target_content == 'P') {
         goto move_pacman_invalid;
     }
 
@@ -140,35 +144,35 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
     board->board[new_index].content = 'P';
 
     if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
+        pthread_mutex_unlock(&board->locks[old_index]);
+        pthread_mutex_unlock(&board->locks[new_index]);
     }
     else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
+        pthread_mutex_unlock(&board->locks[new_index]);
+        pthread_mutex_unlock(&board->locks[old_index]);
     }
     
     return VALID_MOVE;
 
     move_pacman_invalid:
     if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
+        pthread_mutex_unlock(&board->locks[old_index]);
+        pthread_mutex_unlock(&board->locks[new_index]);
     }
     else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
+        pthread_mutex_unlock(&board->locks[new_index]);
+        pthread_mutex_unlock(&board->locks[old_index]);
     }
     return INVALID_MOVE;
 
     move_pacman_dead:
     if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
+        pthread_mutex_unlock(&board->locks[old_index]);
+        pthread_mutex_unlock(&board->locks[new_index]);
     }
     else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
+        pthread_mutex_unlock(&board->locks[new_index]);
+        pthread_mutex_unlock(&board->locks[old_index]);
     }
     return DEAD_PACMAN;
 }
@@ -188,7 +192,7 @@ int move_ghost_charged(board_t* board, int ghost_index, char direction) {
             if (y == 0) return INVALID_MOVE;
 
             for (int i = 0; i <= y; i++) {
-                pthread_mutex_lock(&board->board[i * board->width + x].lock);
+                charge_lock(board, i * board->width + x);
             }
 
             new_y = 0; // In case there is no colision
@@ -207,14 +211,14 @@ int move_ghost_charged(board_t* board, int ghost_index, char direction) {
             }
 
             for (int i = 0; i <= y; i++) {
-                pthread_mutex_unlock(&board->board[i * board->width + x].lock);
+                pthread_mutex_unlock(&board->locks[i * board->width + x]);
             }
             break;
         case 'S':
             if (y == board->height - 1) return INVALID_MOVE;
 
             for (int i = y; i < board->height; i++) {
-                pthread_mutex_lock(&board->board[i * board->width + x].lock);
+                charge_lock(board, i * board->width + x);
             }
 
             new_y = board->height - 1; // In case there is no colision
@@ -233,14 +237,14 @@ int move_ghost_charged(board_t* board, int ghost_index, char direction) {
             }
 
             for (int i = y; i < board->height; i++) {
-                pthread_mutex_unlock(&board->board[i * board->width + x].lock);
+                pthread_mutex_unlock(&board->locks[i * board->width + x]);
             }
             break;
         case 'A':
             if (x == 0) return INVALID_MOVE;
 
             for (int j = 0; j <= x; j++) {
-                pthread_mutex_lock(&board->board[y * board->width + j].lock);
+                charge_lock(board, y * board->width + j);
             }
 
             new_x = 0; // In case there is no colision
@@ -259,14 +263,14 @@ int move_ghost_charged(board_t* board, int ghost_index, char direction) {
             }
 
             for (int j = 0; j <= x; j++) {
-                pthread_mutex_unlock(&board->board[y * board->width + j].lock);
+                pthread_mutex_unlock(&board->locks[y * board->width + j]);
             }
             break;
         case 'D':
             if (x == board->width - 1) return INVALID_MOVE;
 
             for (int j = x; j < board->width; j++) {
-                pthread_mutex_lock(&board->board[y * board->width + j].lock);
+                charge_lock(board, y * board->width + j);
             }
 
             new_x = board->width - 1; // In case there is no colision
@@ -285,7 +289,7 @@ int move_ghost_charged(board_t* board, int ghost_index, char direction) {
             }
 
             for (int j = x; j < board->width; j++) {
-                pthread_mutex_unlock(&board->board[y * board->width + j].lock);
+                pthread_mutex_unlock(&board->locks[y * board->width + j]);
             }
             break;
         default:
@@ -304,7 +308,87 @@ int move_ghost_charged(board_t* board, int ghost_index, char direction) {
     return result;
 }
 
-int move_ghost(board_t* board, int ghost_index, command_t* command) {
+// Identifies where the live pacmans are, 0 when none is
+static uint64_t pacmans_key(board_t *board) {
+    uint64_t key = 0;
+    for (int p = 0; p < board->n_pacmans; p++) {
+        pacman_t *pac = &board->pacmans[p];
+        if (!pac->alive) continue;
+        key = (key ^ (uint64_t) (get_board_index(board, pac->pos_x, pac->pos_y) + 1)) * 1099511628211ull;
+        key |= 1;
+    }
+    return key;
+}
+
+// Breadth first search from the cells of every live pacman, a hunter goes for the
+// closest one. Walls are the only thing that never moves. Must be called with flow_lock held
+static void build_flow(board_t *board, uint64_t key) {
+    int cells = board->width * board->height;
+    // only a board hunted by a ghost moved outside a script gets here without them, like the bench's
+    if (!board->flow) {
+        board->flow = pool_calloc(cells, sizeof(int));
+        board->flow_queue = pool_calloc(cells, sizeof(int));
+    }
+    for (int i = 0; i < cells; i++) board->flow[i] = -1;
+
+    int *queue = board->flow_queue;
+    int head = 0, tail = 0;
+    for (int p = 0; p < board->n_pacmans; p++) {
+        pacman_t *pac = &board->pacmans[p];
+        int target = get_board_index(board, pac->pos_x, pac->pos_y);
+        if (!pac->alive || board->flow[target] == 0) continue;
+        board->flow[target] = 0;
+        queue[tail++] = target;
+    }
+    while (head < tail) {
+        int index = queue[head++];
+        int y = index / board->width;
+        int x = index - y * board->width;
+        int neighbours[4] = {
+            y > 0 ? index - board->width : -1,
+            x > 0 ? index - 1 : -1,
+            y < board->height - 1 ? index + board->width : -1,
+            x < board->width - 1 ? index + 1 : -1,
+        };
+        for (int i = 0; i < 4; i++) {
+            int next = neighbours[i];
+            if (next < 0 || board->flow[next] >= 0 || board->board[next].content == 'W') continue;
+            board->flow[next] = board->flow[index] + 1;
+            queue[tail++] = next;
+        }
+    }
+    board->flow_key = key;
+}
+
+// The step from x, y that gets closest to a pacman, '\0' if there is none
+static char flow_direction(board_t *board, int x, int y) {
+    // one field for every hunter, rebuilt only when a pacman is somewhere else
+    pthread_mutex_lock(&board->flow_lock);
+    uint64_t key = pacmans_key(board);
+    if (key == 0) {
+        pthread_mutex_unlock(&board->flow_lock);
+        return '\0';
+    }
+    if (board->flow_key != key) build_flow(board, key);
+
+    static const char directions[4] = {'W', 'A', 'S', 'D'};
+    static const int dx[4] = {0, -1, 0, 1};
+    static const int dy[4] = {-1, 0, 1, 0};
+    char best = '\0';
+    int best_distance = board->flow[get_board_index(board, x, y)];
+    for (int i = 0; i < 4 && best_distance > 0; i++) {
+        if (!is_valid_position(board, x + dx[i], y + dy[i])) continue;
+        int distance = board->flow[get_board_index(board, x + dx[i], y + dy[i])];
+        if (distance >= 0 && distance < best_distance) {
+            best_distance = distance;
+            best = directions[i];
+        }
+    }
+    pthread_mutex_unlock(&board->flow_lock);
+    return best;
+}
+
+int move_ghost(board_t* board, int ghost_index, const command_t* command) {
     ghost_t* ghost = &board->ghosts[ghost_index];
     int new_x = ghost->pos_x;
     int new_y = ghost->pos_y;
@@ -323,6 +407,15 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
         direction = directions[rand() % 4];
     }
 
+    // Hunt: one step along the shortest path to the pacman
+    if (direction == 'H') {
+        direction = flow_direction(board, ghost->pos_x, ghost->pos_y);
+        if (direction == '\0') {
+            ghost->pc++;
+            return VALID_MOVE;
+        }
+    }
+
     // Calculate new position based on direction
     switch (direction) {
         case 'W': // Up
@@ -338,22 +431,19 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
             new_x++;
             break;
         case 'C': // Charge
-            ghost->current_move += 1;
+            ghost->pc += 1;
             ghost->charged = 1;
             return VALID_MOVE;
         case 'T': // Wait
-            if (command->turns_left == 1) {
-                ghost->current_move += 1; // move on
-                command->turns_left = command->turns;
-            }
-            else command->turns_left -= 1;
+            if (ghost->turns_left == 0) ghost->turns_left = command->turns;
+            if (--ghost->turns_left == 0) ghost->pc += 1; // move on
             return VALID_MOVE;
         default:
             return INVALID_MOVE; // Invalid direction
     }
 
     // Logic for the WASD movement
-    ghost->current_move++;
+    ghost->pc++;
     if (ghost->charged)
         return move_ghost_charged(board, ghost_index, direction);
 
@@ -368,12 +458,12 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
 
     // locks
     if (old_index < new_index) {
-        pthread_mutex_lock(&board->board[old_index].lock);
-        pthread_mutex_lock(&board->board[new_index].lock);
+        cell_lock(board, old_index);
+        cell_lock(board, new_index);
     }
     else {
-        pthread_mutex_lock(&board->board[new_index].lock);
-        pthread_mutex_lock(&board->board[old_index].lock);
+        cell_lock(board, new_index);
+        cell_lock(board, old_index);
     }
 
     char target_content = board->board[new_index].content;
@@ -411,28 +501,67 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
     board->board[new_index].content = 'M';
 
     if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
+        pthread_mutex_unlock(&board->locks[old_index]);
+        pthread_mutex_unlock(&board->locks[new_index]);
     }
     else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
+        pthread_mutex_unlock(&board->locks[new_index]);
+        pthread_mutex_unlock(&board->locks[old_index]);
     }
     
     return result;
 
     move_ghost_invalid:
     if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
+        pthread_mutex_unlock(&board->locks[old_index]);
+        pthread_mutex_unlock(&board->locks[new_index]);
     }
     else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
+        pthread_mutex_unlock(&board->locks[new_index]);
+        pthread_mutex_unlock(&board->locks[old_index]);
     }
     return INVALID_MOVE;
 }
 
+void board_to_string(board_t* board, char* output) {
+    board_to_string_rows(board, output, 0, board->height);
+}
+
+void board_to_string_rows(board_t* board, char* output, int first_row, int end_row) {
+    size_t pos = (size_t) first_row * board->width;
+    
+    for (int y = first_row; y < end_row; y++) {
+        for (int x = 0; x < board->width; x++) {
+            int index = y * board->width + x;
+            char ch = board->board[index].content;
+
+            switch (ch) {
+                case 'W': output[pos++] = '#'; break;
+                case 'P': output[pos++] = 'C'; break;
+                case 'M': {
+                    // only cells with a ghost look for it, not every cell of the board
+                    int ghost_charged = 0;
+                    for (int g = 0; g < board->n_ghosts; g++) {
+                        ghost_t* ghost = &board->ghosts[g];
+                        if (ghost->pos_x == x && ghost->pos_y == y) {
+                            if (ghost->charged) ghost_charged = 1;
+                            break;
+                        }
+                    }
+                    output[pos++] = ghost_charged ? 'G' : 'M';
+                    break;
+                }
+                case ' ': 
+                    if (board->board[index].has_portal) output[pos++] = '@';
+                    else if (board->board[index].has_dot) output[pos++] = '.';
+                    else output[pos++] = ' ';
+                    break;
+                default: output[pos++] = ch; break;
+            }
+        }
+    }
+}
+
 void kill_pacman(board_t* board, int pacman_index) {
     debug("Killing %d pacman\n\n", pacman_index);
     pacman_t* pac = &board->pacmans[pacman_index];
@@ -466,56 +595,212 @@ int load_ghost(board_t* board) {
     return 0;
 }
 
-int load_level(board_t *board, char *filename, char* dirname, int points) {
+int load_level_data(board_t *board, char *filename, char* dirname, int points) {
 
-    if (read_level(board, filename, dirname) < 0) {
-        printf("Failed to load level\n");
-        return -1;
+    // a compiled .lvlb skips the parser, see levelbin.h
+    board->image = NULL;
+    board->own_pacmans = 0;
+    if (levelbin_load(board, filename, dirname, points) != 0) {
+        if (read_level(board, filename, dirname) < 0) {
+            printf("Failed to load level\n");
+            return -1;
+        }
+
+        if (read_pacman(board, points) < 0) {
+            printf("Failed to load the pacman\n");
+        }
+
+        if (read_ghosts(board) < 0) {
+            printf("Failed to read ghosts\n");
+        }
+    }
+
+    // a ghost cycles through its moves, one without any (or too many) can't be played
+    for (int i = 0; i < board->n_ghosts; i++) {
+        if (!board->ghosts[i].script) {
+            debug("Ghost %d of %s has no moves\n", i, filename);
+            unload_level_data(board);
+            return -1;
+        }
     }
+    return 0;
+}
 
-    if (read_pacman(board, points) < 0) {
-        printf("Failed to load the pacman\n");
+void unload_level_data(board_t *board) {
+    if (board->image) {
+        if (board->own_pacmans) pool_free(board->pacmans);
+        levelbin_unload(board);
+        return;
     }
+    for (int i = 0; i < board->n_pacmans; i++) script_release(board->pacmans[i].script);
+    for (int i = 0; i < board->n_ghosts; i++) script_release(board->ghosts[i].script);
+    pool_free(board->board);
+    pool_free(board->pacmans);
+    pool_free(board->ghosts);
+    board->board = NULL;
+    board->pacmans = NULL;
+    board->ghosts = NULL;
+}
 
-    if (read_ghosts(board) < 0) {
-        printf("Failed to read ghosts\n");
+static bool has_hunter(board_t *board) {
+    for (int g = 0; g < board->n_ghosts; g++) {
+        const script_t *script = board->ghosts[g].script;
+        for (int i = 0; script && i < script->n_ops; i++) {
+            if (script->ops[i].command == 'H') return true;
+        }
     }
+    return false;
+}
 
+// What playing the level needs on top of its data. Allocated here, on the session
+// worker and from its pool, the entity threads that use it have no pool of their own
+static void init_level_state(board_t *board) {
     pthread_rwlock_init(&board->state_lock, NULL);
+    board->thread_shutdown = 0;
+    board->flow = NULL;
+    board->flow_queue = NULL;
+    board->flow_key = 0;
+    pthread_mutex_init(&board->flow_lock, NULL);
+    if (has_hunter(board)) {
+        board->flow = pool_calloc(board->height * board->width, sizeof(int));
+        board->flow_queue = pool_calloc(board->height * board->width, sizeof(int));
+    }
 
+    board->locks = pool_calloc(board->height * board->width, sizeof(pthread_mutex_t));
     for (int i = 0; i < board->height * board->width; i++) {
-        pthread_mutex_init(&board->board[i].lock, NULL);
+        pthread_mutex_init(&board->locks[i], NULL);
     }
 
+#ifdef LOCK_PROFILE
+    board->lock_heat = pool_calloc(board->height * board->width, sizeof(lock_heat_t));
+#endif
+}
+
+int load_level(board_t *board, char *filename, char* dirname, int points) {
+    if (load_level_data(board, filename, dirname, points) != 0) return -1;
+    init_level_state(board);
     //print_board(board);
     return 0;
 }
 
+int clone_level(board_t *board, const board_t *level, int points) {
+    *board = *level;
+    board->image = NULL;
+    board->own_pacmans = 0;
+    int cells = level->width * level->height;
+    board->board = pool_calloc(cells, sizeof(board_pos_t));
+    board->pacmans = pool_calloc(level->n_pacmans, sizeof(pacman_t));
+    board->ghosts = pool_calloc(level->n_ghosts, sizeof(ghost_t));
+    if (!board->board || !board->pacmans || (level->n_ghosts && !board->ghosts)) {
+        pool_free(board->board);
+        pool_free(board->pacmans);
+        pool_free(board->ghosts);
+        return -1;
+    }
+    memcpy(board->board, level->board, cells * sizeof(board_pos_t));
+    memcpy(board->pacmans, level->pacmans, level->n_pacmans * sizeof(pacman_t));
+    memcpy(board->ghosts, level->ghosts, level->n_ghosts * sizeof(ghost_t));
+    // released by unload_level like the scripts of a parsed level
+    for (int i = 0; i < board->n_pacmans; i++) script_retain(board->pacmans[i].script);
+    for (int i = 0; i < board->n_ghosts; i++) script_retain(board->ghosts[i].script);
+    board->pacmans[0].points = points;
+
+    init_level_state(board);
+    return 0;
+}
+
 void unload_level(board_t * board) {
+#ifdef LOCK_PROFILE
+    lockprof_collect_heatmap(board);
+    pool_free(board->lock_heat);
+    board->lock_heat = NULL;
+#endif
     pthread_rwlock_destroy(&board->state_lock);
     for (int i = 0; i < board->height * board->width; i++) {
-        pthread_mutex_destroy(&board->board[i].lock);
+        pthread_mutex_destroy(&board->locks[i]);
+    }
+    pool_free(board->locks);
+    pthread_mutex_destroy(&board->flow_lock);
+    pool_free(board->flow);
+    pool_free(board->flow_queue);
+    board->flow = NULL;
+    board->flow_queue = NULL;
+    unload_level_data(board);
+}
+
+int spawn_pacmans(board_t *board, int n) {
+    if (n <= board->n_pacmans) return 0;
+    pacman_t *pacmans = pool_calloc(n, sizeof(pacman_t));
+    if (!pacmans) return -1;
+    memcpy(pacmans, board->pacmans, board->n_pacmans * sizeof(pacman_t));
+
+    // spread over the board so players don't start on top of each other
+    int cells = board->width * board->height;
+    for (int p = board->n_pacmans; p < n; p++) {
+        int start = (int) ((int64_t) cells * p / n);
+        int found = -1;
+        for (int i = 0; i < cells && found < 0; i++) {
+            int index = (start + i) % cells;
+            if (board->board[index].content == ' ' && !board->board[index].has_portal) found = index;
+        }
+        if (found < 0) {
+            for (int q = board->n_pacmans; q < p; q++) {
+                board->board[get_board_index(board, pacmans[q].pos_x, pacmans[q].pos_y)].content = ' ';
+            }
+            pool_free(pacmans);
+            return -1;
+        }
+        board->board[found].content = 'P';
+        pacmans[p].pos_x = found % board->width;
+        pacmans[p].pos_y = found / board->width;
+        pacmans[p].alive = 1;
+        pacmans[p].points = pacmans[0].points;
     }
-    free(board->board);
-    free(board->pacmans);
-    free(board->ghosts);
+
+    if (board->image == NULL || board->own_pacmans) pool_free(board->pacmans);
+    board->pacmans = pacmans;
+    board->n_pacmans = n;
+    board->own_pacmans = 1;
+    return 0;
 }
 
-void open_debug_file(char *filename) {
-    debugfile = fopen(filename, "w");
+int checkpoint_init(board_checkpoint_t *checkpoint, board_t *board) {
+    checkpoint->board = pool_calloc(board->width * board->height, sizeof(board_pos_t));
+    checkpoint->pacmans = pool_calloc(board->n_pacmans, sizeof(pacman_t));
+    checkpoint->ghosts = pool_calloc(board->n_ghosts, sizeof(ghost_t));
+    checkpoint->saved = 0;
+    if (!checkpoint->board || !checkpoint->pacmans || (board->n_ghosts && !checkpoint->ghosts)) {
+        checkpoint_free(checkpoint);
+        return -1;
+    }
+    return 0;
 }
 
-void close_debug_file() {
-    fclose(debugfile);
+void checkpoint_save(board_checkpoint_t *checkpoint, board_t *board) {
+    if (!checkpoint->board) return; // checkpoint_init failed
+    memcpy(checkpoint->board, board->board, board->width * board->height * sizeof(board_pos_t));
+    memcpy(checkpoint->pacmans, board->pacmans, board->n_pacmans * sizeof(pacman_t));
+    memcpy(checkpoint->ghosts, board->ghosts, board->n_ghosts * sizeof(ghost_t));
+    checkpoint->saved = 1;
 }
 
-void debug(const char * format, ...) {
-    va_list args;
-    va_start(args, format);
-    vfprintf(debugfile, format, args);
-    va_end(args);
+int checkpoint_restore(board_checkpoint_t *checkpoint, board_t *board) {
+    if (!checkpoint->saved) return -1;
+    memcpy(board->board, checkpoint->board, board->width * board->height * sizeof(board_pos_t));
+    memcpy(board->pacmans, checkpoint->pacmans, board->n_pacmans * sizeof(pacman_t));
+    memcpy(board->ghosts, checkpoint->ghosts, board->n_ghosts * sizeof(ghost_t));
+    checkpoint->saved = 0;
+    return 0;
+}
 
-    fflush(debugfile);
+void checkpoint_free(board_checkpoint_t *checkpoint) {
+    pool_free(checkpoint->board);
+    pool_free(checkpoint->pacmans);
+    pool_free(checkpoint->ghosts);
+    checkpoint->board = NULL;
+    checkpoint->pacmans = NULL;
+    checkpoint->ghosts = NULL;
+    checkpoint->saved = 0;
 }
 
 void print_board(board_t *board) {
@@ -0,0 +1,360 @@
+#include "board.h"
+#include "parser.h"
+#include "pool.h"
+#include "shard.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Microbenchmarks for the board engine hot paths.
+// Linked with -Wl,--wrap for the allocator so allocations done by board.o/parser.o are counted.
+
+static const int dims[] = {8, 64, 256, 1024, 4096};
+static const int ghost_counts[] = {1, 4, 8, 16, MAX_GHOSTS - 1, 100, 1000};
+
+#define N_DIMS (int)(sizeof(dims) / sizeof(dims[0]))
+#define N_GHOST_COUNTS (int)(sizeof(ghost_counts) / sizeof(ghost_counts[0]))
+
+static long allocations = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void *ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size) {
+    allocations++;
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void *ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+static int max_dim = 4096;
+static int max_ghosts = 1000;
+static int n_shards = 0; // -j, the cores of the machine by default
+static long min_time_ns = 200000000L;
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+typedef void (*bench_op_t)(board_t *board, long iteration);
+
+static void report(const char *name, int dim, int ghosts, long iterations, long elapsed, long allocs) {
+    printf("%-24s %6d %7d %14.1f %12.2f\n", name, dim, ghosts,
+           (double) elapsed / iterations, (double) allocs / iterations);
+    fflush(stdout);
+}
+
+// Runs op until min_time_ns has passed (at least once) and reports ns/op and allocs/op
+static void run(const char *name, int dim, int ghosts, board_t *board, bench_op_t op) {
+    long iterations = 0;
+    long allocs_before = allocations;
+    long start = now_ns();
+    long elapsed;
+
+    // grow the batch between clock reads so cheap ops are not dominated by the timer
+    // and slow ones (a 4096^2 read_level) still stop after a single run
+    int batch = 1;
+    do {
+        for (int i = 0; i < batch; i++) {
+            op(board, iterations++);
+        }
+        if (batch < 1024) batch *= 2;
+        elapsed = now_ns() - start;
+    } while (elapsed < min_time_ns);
+
+    report(name, dim, ghosts, iterations, elapsed, allocations - allocs_before);
+}
+
+// Empty dim x dim board surrounded by walls, with the pacman in the middle and
+// n_ghosts spread on every other row so each one has free cells around it
+static int build_board(board_t *board, int dim, int n_ghosts) {
+    memset(board, 0, sizeof(board_t));
+    board->width = dim;
+    board->height = dim;
+    board->tempo = 1;
+    board->n_pacmans = 1;
+    board->n_ghosts = n_ghosts;
+    board->board = calloc((size_t) dim * dim, sizeof(board_pos_t));
+    board->locks = calloc((size_t) dim * dim, sizeof(pthread_mutex_t));
+    board->pacmans = calloc(1, sizeof(pacman_t));
+    board->ghosts = calloc(n_ghosts, sizeof(ghost_t));
+    if (!board->board || !board->locks || !board->pacmans || !board->ghosts) return -1;
+
+    for (int y = 0; y < dim; y++) {
+        for (int x = 0; x < dim; x++) {
+            board_pos_t *cell = &board->board[y * dim + x];
+            pthread_mutex_init(&board->locks[y * dim + x], NULL);
+            if (x == 0 || y == 0 || x == dim - 1 || y == dim - 1) cell->content = 'W';
+            else cell->content = ' ';
+        }
+    }
+
+    pacman_t *pacman = &board->pacmans[0];
+    pacman->alive = 1;
+    pacman->pos_x = dim / 2;
+    pacman->pos_y = dim / 2;
+    board->board[pacman->pos_y * dim + pacman->pos_x].content = 'P';
+
+    int per_row = (dim - 2) / 4;
+    for (int g = 0; g < n_ghosts; g++) {
+        ghost_t *ghost = &board->ghosts[g];
+        ghost->pos_x = 2 + (g % per_row) * 4;
+        ghost->pos_y = 1 + (g / per_row) * 2;
+        if (ghost->pos_y == pacman->pos_y) ghost->pos_y++;
+        board->board[ghost->pos_y * dim + ghost->pos_x].content = 'M';
+    }
+
+    pthread_rwlock_init(&board->state_lock, NULL);
+    pthread_mutex_init(&board->flow_lock, NULL);
+    return 0;
+}
+
+static void free_board(board_t *board) {
+    pthread_rwlock_destroy(&board->state_lock);
+    for (int i = 0; i < board->width * board->height; i++) {
+        pthread_mutex_destroy(&board->locks[i]);
+    }
+    free(board->locks);
+    free(board->board);
+    free(board->pacmans);
+    free(board->ghosts);
+    pthread_mutex_destroy(&board->flow_lock);
+    pool_free(board->flow);
+    pool_free(board->flow_queue);
+}
+
+static int fits(int dim, int n_ghosts) {
+    int per_row = (dim - 2) / 4;
+    return per_row > 0 && (n_ghosts + per_row - 1) / per_row * 2 + 2 < dim;
+}
+
+static command_t steps[2] = {{'D', 1}, {'A', 1}};
+
+static void op_move_pacman(board_t *board, long iteration) {
+    move_pacman(board, 0, &steps[iteration & 1]);
+}
+
+static void op_move_ghost(board_t *board, long iteration) {
+    int g = iteration % board->n_ghosts;
+    ghost_t *ghost = &board->ghosts[g];
+    move_ghost(board, g, &steps[ghost->pc & 1]);
+}
+
+static void op_move_ghost_charged(board_t *board, long iteration) {
+    (void) iteration;
+    ghost_t *ghost = &board->ghosts[0];
+    // bounce between both walls of the row so every ray crosses the whole board
+    move_ghost_charged(board, 0, ghost->pos_x <= 1 ? 'D' : 'A');
+}
+
+static command_t hunt = {'H', 1};
+
+// One step towards the pacman and back, no ghost starts in the pacman's column so none reaches it
+static void hunt_and_return(board_t *board, int g) {
+    ghost_t *ghost = &board->ghosts[g];
+    int x = ghost->pos_x, y = ghost->pos_y;
+    move_ghost(board, g, &hunt);
+    command_t back = {ghost->pos_x > x ? 'A' : ghost->pos_x < x ? 'D' : ghost->pos_y > y ? 'W' : 'S', 1};
+    if (ghost->pos_x != x || ghost->pos_y != y) move_ghost(board, g, &back);
+}
+
+// Every ghost reads the same field, it is only built again when the pacman moves
+static void op_hunt(board_t *board, long iteration) {
+    hunt_and_return(board, iteration % board->n_ghosts);
+}
+
+static void op_hunt_after_pacman_move(board_t *board, long iteration) {
+    move_pacman(board, 0, &steps[iteration & 1]);
+    hunt_and_return(board, 0);
+}
+
+static board_checkpoint_t checkpoint;
+
+static void op_checkpoint(board_t *board, long iteration) {
+    (void) iteration;
+    checkpoint_save(&checkpoint, board);
+    checkpoint_restore(&checkpoint, board);
+}
+
+static char *encode_buffer;
+
+static void op_board_to_string(board_t *board, long iteration) {
+    (void) iteration;
+    board_to_string(board, encode_buffer);
+}
+
+static shard_pool_t *shards = NULL;
+
+static void encode_band(void *arg, int shard, int n) {
+    board_t *board = (board_t*) arg;
+    board_to_string_rows(board, encode_buffer, board->height * shard / n, board->height * (shard + 1) / n);
+}
+
+// The way the server encodes a big board, one band of rows per shard
+static void op_board_to_string_sharded(board_t *board, long iteration) {
+    (void) iteration;
+    shard_run(shards, encode_band, board);
+}
+
+static char level_dir[] = "/tmp/board_bench_XXXXXX";
+static char level_file[64];
+
+static void op_read_level(board_t *board, long iteration) {
+    (void) iteration;
+    read_level(board, level_file, level_dir);
+    pool_free(board->board);
+    pool_free(board->pacmans);
+    pool_free(board->ghosts);
+}
+
+static void op_load_level(board_t *board, long iteration) {
+    (void) iteration;
+    load_level(board, level_file, level_dir, 0);
+    unload_level(board);
+}
+
+static void write_file(const char *path, const char *contents) {
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    if (fd < 0) return;
+    write(fd, contents, strlen(contents));
+    close(fd);
+}
+
+// Writes <dim>_<ghosts>.lvl and its ghost scripts into level_dir, sets level_file
+static int write_level(int dim, int n_ghosts) {
+    char path[MAX_FILENAME];
+    int per_row = (dim - 2) / 4;
+
+    for (int g = 0; g < n_ghosts; g++) {
+        char script[128];
+        snprintf(script, sizeof(script), "PASSO 0\nPOS %d %d\nD\nA\n",
+                 2 + (g % per_row) * 4, 1 + (g / per_row) * 2);
+        snprintf(path, sizeof(path), "%s/g%d.m", level_dir, g);
+        write_file(path, script);
+    }
+
+    snprintf(level_file, sizeof(level_file), "%d_%d.lvl", dim, n_ghosts);
+    snprintf(path, sizeof(path), "%s/%s", level_dir, level_file);
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+
+    fprintf(fp, "DIM %d %d\nTEMPO 1\nMON", dim, dim);
+    for (int g = 0; g < n_ghosts; g++) fprintf(fp, " g%d.m", g);
+    fprintf(fp, "\n");
+    for (int y = 0; y < dim; y++) {
+        for (int x = 0; x < dim; x++) {
+            fputc((x == 0 || y == 0 || x == dim - 1 || y == dim - 1) ? 'X' : 'o', fp);
+        }
+        fputc('\n', fp);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void bench_in_memory(int dim) {
+    board_t board;
+
+    if (build_board(&board, dim, 1) == 0) {
+        run("move_pacman", dim, 0, &board, op_move_pacman);
+        run("move_ghost_charged", dim, 1, &board, op_move_ghost_charged);
+        run("hunt (pacman moved)", dim, 1, &board, op_hunt_after_pacman_move);
+        if (checkpoint_init(&checkpoint, &board) == 0) {
+            run("checkpoint_save+restore", dim, 1, &board, op_checkpoint);
+            checkpoint_free(&checkpoint);
+        }
+    }
+    free_board(&board);
+
+    encode_buffer = malloc((size_t) dim * dim);
+    for (int i = 0; i < N_GHOST_COUNTS; i++) {
+        int n_ghosts = ghost_counts[i];
+        if (n_ghosts > max_ghosts || !fits(dim, n_ghosts)) continue;
+        if (build_board(&board, dim, n_ghosts) != 0) {
+            free_board(&board);
+            continue;
+        }
+        run("move_ghost", dim, n_ghosts, &board, op_move_ghost);
+        run("move_ghost hunt+back", dim, n_ghosts, &board, op_hunt);
+        run("board_to_string", dim, n_ghosts, &board, op_board_to_string);
+        if (shards) run("board_to_string sharded", dim, n_ghosts, &board, op_board_to_string_sharded);
+        free_board(&board);
+    }
+    free(encode_buffer);
+}
+
+static void bench_levels(int dim) {
+    board_t board;
+
+    // the level format stops at MAX_GHOSTS - 1 monster files
+    for (int i = 0; i < N_GHOST_COUNTS; i++) {
+        int n_ghosts = ghost_counts[i];
+        if (n_ghosts > MAX_GHOSTS - 1 || n_ghosts > max_ghosts || !fits(dim, n_ghosts)) continue;
+        if (write_level(dim, n_ghosts) != 0) continue;
+
+        memset(&board, 0, sizeof(board));
+        run("read_level", dim, n_ghosts, &board, op_read_level);
+        memset(&board, 0, sizeof(board));
+        run("load_level+unload_level", dim, n_ghosts, &board, op_load_level);
+
+        // the way session workers load levels, storage comes back from the free lists
+        static pool_t *pool = NULL;
+        if (!pool) pool = pool_create();
+        pool_use(pool);
+        memset(&board, 0, sizeof(board));
+        run("load_level (pooled)", dim, n_ghosts, &board, op_load_level);
+        pool_use(NULL);
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:g:t:j:")) != -1) {
+        switch (opt) {
+            case 's': max_dim = atoi(optarg); break;
+            case 'g': max_ghosts = atoi(optarg); break;
+            case 't': min_time_ns = atol(optarg) * 1000000L; break;
+            case 'j': n_shards = atoi(optarg); break;
+            default:
+                printf("Usage: %s [-s max_dim] [-g max_ghosts] [-t min_time_ms] [-j shards]\n", argv[0]);
+                return -1;
+        }
+    }
+
+    if (!mkdtemp(level_dir)) {
+        perror("mkdtemp");
+        return -1;
+    }
+
+    // parser and board log through debug(), keep that out of the numbers
+    open_debug_file("/dev/null");
+
+    shards = shard_pool_create(n_shards > 0 ? n_shards : (int) sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-24s %6s %7s %14s %12s\n", "benchmark", "dim", "ghosts", "ns/op", "allocs/op");
+    for (int i = 0; i < N_DIMS && dims[i] <= max_dim; i++) {
+        bench_in_memory(dims[i]);
+        bench_levels(dims[i]);
+    }
+
+    close_debug_file();
+    shard_pool_destroy(shards);
+
+    char command[MAX_FILENAME];
+    snprintf(command, sizeof(command), "rm -rf %s", level_dir);
+    system(command);
+    return 0;
+}
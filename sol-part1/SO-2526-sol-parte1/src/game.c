@@ -1,5 +1,17 @@
 #include "board.h"
 #include "display.h"
+#include "histogram.h"
+#include "stats.h"
+#include "trace.h"
+#include "vclock.h"
+#include "leaderboard.h"
+#include "scorelog.h"
+#include "snapshot.h"
+#include "levelindex.h"
+#include "pool.h"
+#include "parser.h"
+#include "script.h"
+#include "shard.h"
 #include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,7 +20,6 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <unistd.h>
-#include <sys/wait.h>
 #include <pthread.h>
 #include <errno.h>
 #include <sys/stat.h>
@@ -17,48 +28,93 @@
 #include <stdbool.h>
 #include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <poll.h>
 
 #define MAX_PIPE_PATH_LENGTH 40
+#define MAX_SPECTATORS 16
+#define MAX_PENDING_INPUTS 8
+#define MAX_ROOM_PLAYERS 256
+// smaller boards are encoded by the update thread alone, waking the shards costs more
+#define SHARD_MIN_CELLS (256 * 256)
+
+// op code + req_path + notif_path
+#define REGISTRATION_MSG_SIZE 81
+#define REGISTRATION_BATCH 64
 
 #define CONTINUE_PLAY 0
 #define NEXT_LEVEL 1
 #define QUIT_GAME 2
 #define LOAD_BACKUP 3
-#define CREATE_BACKUP 4
 
 enum {
   OP_CODE_CONNECT = 1,
   OP_CODE_DISCONNECT = 2,
   OP_CODE_PLAY = 3,
   OP_CODE_BOARD = 4,
+  OP_CODE_SPECTATE = 5,
 };
 
+// A read-only observer. A frame the pipe only took part of is finished from
+// backlog on the next ticks, the frames in between are skipped
+typedef struct {
+    int fd; // opened non-blocking
+    char *backlog;
+    size_t backlog_len, backlog_sent, backlog_capacity;
+} spectator_t;
+
 typedef struct {
     int req_pipe_fd;
     int notif_pipe_fd;
     char req_pipe_path[MAX_PIPE_PATH_LENGTH];
     char notif_pipe_path[MAX_PIPE_PATH_LENGTH];
+    char id[MAX_PIPE_PATH_LENGTH]; // client id taken from the notification pipe name
     board_t *board;
     bool active;
     bool disconnected; 
+    spectator_t spectators[MAX_SPECTATORS];
+    int n_spectators;
+    uint64_t pending_inputs[MAX_PENDING_INPUTS]; // arrival of plays applied but not yet sent in a frame
+    int n_pending_inputs;
+    histogram_t input_latency; // OP_CODE_PLAY arrival -> first frame written after it was applied
+    atomic_uint_fast64_t frames_sent;
+    atomic_uint_fast64_t bytes_written; // player and spectators together
+    int slot; // index in active_sessions, also its leaderboard slot
+    vclock_interrupt_t round_end; // cuts the entity sleeps short when a round ends or the client is lost
     pthread_mutex_t session_mutex;
 } session_t;
 
 typedef struct {
     board_t *board;
+    session_t *session; // the room's first player, names it in traces
+    vclock_interrupt_t *round_end;
     int ghost_index;
 } ghost_thread_arg_t;
 
 typedef struct {
     board_t *board;
     session_t *session;
+    board_checkpoint_t *checkpoint;
+    snapshot_t *snapshot; // NULL unless PACMAN_SNAPSHOT_EVERY is set and the player is alone
+    int index; // of the pacman this player controls
+    int result; // CONTINUE_PLAY .. LOAD_BACKUP, set when the thread returns
 } pacman_thread_arg_t;
 
+typedef struct {
+    board_t *board;
+    session_t **players;
+    int n_players;
+    board_checkpoint_t *checkpoint; // a death with a save to go back to is not the end
+    vclock_interrupt_t *round_end;
+    char *frame; // kept between levels, only grows when a level is bigger
+    size_t frame_capacity;
+    shard_pool_t *shards; // created by the first board big enough, kept like the frame
+} board_update_arg_t;
 
-typedef struct{
-    char id[MAX_PIPE_PATH_LENGTH];
-    int score;
-}player_score_t;
+typedef struct {
+    board_t *board;
+    char *output;
+} frame_job_t;
 
 session_t *current_session = NULL;
 pthread_mutex_t session_management_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -75,8 +131,16 @@ pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 char* global_level_dir = NULL;
 
+// PACMAN_ROOM_SIZE players share a board, the first one waits PACMAN_ROOM_WAIT_MS for the others
+int room_size = 1;
+int room_wait_ms = 1000;
+// PACMAN_FRAME_SHARDS threads encode the frame of a big board, one band of rows each.
+// Every session worker gets its own shard threads, so it stays off unless asked for
+int frame_shards = 1;
+
 
 static volatile sig_atomic_t got_sigusr1 = 0;
+static volatile sig_atomic_t got_stop = 0; // SIGTERM or SIGINT, which one
 session_t *active_sessions[MAX_SESSIONS_BUFFER] = {NULL};
 pthread_mutex_t active_sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -94,51 +158,82 @@ int write_all(int fd, const void *buffer, size_t len) {
     return 0;
 }
 
-static char* board_to_string(board_t* board) {
-    size_t buffer_size = board->width * board->height;
-    char* output = malloc(buffer_size);
-    size_t pos = 0;
-    
-    for (int y = 0; y < board->height; y++) {
-        for (int x = 0; x < board->width; x++) {
-            int index = y * board->width + x;
-            char ch = board->board[index].content;
-            int ghost_charged = 0;
-
-            for (int g = 0; g < board->n_ghosts; g++) {
-                ghost_t* ghost = &board->ghosts[g];
-                if (ghost->pos_x == x && ghost->pos_y == y) {
-                    if (ghost->charged) ghost_charged = 1;
-                    break;
-                }
-            }
+static void drop_spectator(session_t *session, int i) {
+    close(session->spectators[i].fd);
+    free(session->spectators[i].backlog);
+    session->spectators[i] = session->spectators[--session->n_spectators];
+}
 
-            switch (ch) {
-                case 'W': output[pos++] = '#'; break;
-                case 'P': output[pos++] = 'C'; break;
-                case 'M': output[pos++] = ghost_charged ? 'G' : 'M'; break;
-                case ' ': 
-                    if (board->board[index].has_portal) output[pos++] = '@';
-                    else if (board->board[index].has_dot) output[pos++] = '.';
-                    else output[pos++] = ' ';
-                    break;
-                default: output[pos++] = ch; break;
-            }
+// Writes what is left of the spectator's unfinished frame. Returns the bytes
+// written, or -1 if the pipe is broken
+static ssize_t flush_backlog(spectator_t *spectator) {
+    ssize_t ret = write(spectator->fd, spectator->backlog + spectator->backlog_sent,
+                        spectator->backlog_len - spectator->backlog_sent);
+    if (ret < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    spectator->backlog_sent += ret;
+    return ret;
+}
+
+// How long the end of a session waits for a spectator to take the rest of its last frame
+#define SPECTATOR_CLOSE_WAIT_MS 200
+
+// Closes every spectator of a session that is over. One still owed part of a
+// frame gets it if its pipe drains in time, so it never ends on half a frame
+static void close_spectators(session_t *session) {
+    uint64_t deadline = monotonic_ns() + (uint64_t) SPECTATOR_CLOSE_WAIT_MS * 1000000;
+    for (int i = 0; i < session->n_spectators; i++) {
+        spectator_t *spectator = &session->spectators[i];
+        while (spectator->backlog_sent < spectator->backlog_len && monotonic_ns() < deadline) {
+            struct pollfd ready = {spectator->fd, POLLOUT, 0};
+            int wait_ms = (int) ((deadline - monotonic_ns()) / 1000000) + 1;
+            if (poll(&ready, 1, wait_ms) <= 0 || flush_backlog(spectator) < 0) break;
         }
     }
-    return output;
+    while (session->n_spectators > 0) drop_spectator(session, 0);
 }
 
-int create_backup() {
-    terminal_cleanup();
-    pid_t child = fork();
-    if(child != 0) {
-        if (child < 0) return -1;
-        return child;
-    } else {
-        debug("[%d] Created\n", getpid());
-        return 0;
+// Sends an already encoded frame to every spectator without ever blocking the game.
+// A full pipe skips the frame, one that takes only part of it gets the rest on the
+// next ticks, so a frame bigger than the pipe still arrives whole. Only a broken
+// pipe drops the spectator.
+// Must be called with session_mutex held. Returns the bytes written.
+static size_t broadcast_frame(session_t *session, const char *frame, size_t len) {
+    size_t sent = 0;
+    for (int i = 0; i < session->n_spectators; ) {
+        spectator_t *spectator = &session->spectators[i];
+        ssize_t ret = 0;
+        if (spectator->backlog_sent < spectator->backlog_len) {
+            ret = flush_backlog(spectator);
+            if (ret < 0) {
+                drop_spectator(session, i);
+                continue;
+            }
+            sent += ret;
+            if (spectator->backlog_sent < spectator->backlog_len) {
+                i++;
+                continue;
+            }
+        }
+
+        ret = write(spectator->fd, frame, len);
+        if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+            drop_spectator(session, i);
+            continue;
+        }
+        if (ret > 0 && (size_t) ret < len) {
+            if (spectator->backlog_capacity < len - ret) {
+                free(spectator->backlog);
+                spectator->backlog = malloc(len - ret);
+                spectator->backlog_capacity = len - ret;
+            }
+            memcpy(spectator->backlog, frame + ret, len - ret);
+            spectator->backlog_len = len - ret;
+            spectator->backlog_sent = 0;
+        }
+        if (ret > 0) sent += ret;
+        i++;
     }
+    return sent;
 }
 
 void screen_refresh(board_t * game_board, int mode) {
@@ -147,64 +242,102 @@ void screen_refresh(board_t * game_board, int mode) {
     refresh_screen();     
 }
 
+// Set by crew_finish once the round is decided
+static bool round_over(board_t *board) {
+    state_rdlock(&board->state_lock);
+    bool over = board->thread_shutdown;
+    pthread_rwlock_unlock(&board->state_lock);
+    return over;
+}
+
 void* pacman_thread(void *arg) {
     pacman_thread_arg_t *pacman_arg = (pacman_thread_arg_t *) arg;
     board_t *board = pacman_arg->board;
     session_t *session = pacman_arg->session;
-    
-    free(pacman_arg);
-
-    pacman_t* pacman = &board->pacmans[0];
-    int *retval = malloc(sizeof(int));
+    board_checkpoint_t *checkpoint = pacman_arg->checkpoint;
+    snapshot_t *snapshot = pacman_arg->snapshot;
+    // the arguments live in the crew, game_session reads the result once the round is over
+    int *retval = &pacman_arg->result;
+    trace_thread_name("pacman");
+
+    int index = pacman_arg->index;
+    pacman_t* pacman = &board->pacmans[index];
+    // in a room another player can end the round
+    bool room = board->n_pacmans > 1;
+    int last_points = pacman->points;
+    int ticks = 0;
 
     while (true) {
         if(!pacman->alive) {
             *retval = LOAD_BACKUP;
-            return (void*) retval;
+            return NULL;
+        }
+        if (room && round_over(board)) {
+            *retval = CONTINUE_PLAY;
+            return NULL;
         }
 
-        sleep_ms(board->tempo * (1 + pacman->passo));
+        // alone nothing else ends the round while the pacman plays, only a lost client
+        if (vclock_sleep_interruptible_ms(board->tempo * (1 + pacman->passo), &session->round_end)) {
+            *retval = room && round_over(board) ? CONTINUE_PLAY : QUIT_GAME;
+            return NULL;
+        }
 
-        command_t* play;
+        const command_t* play;
         command_t c;
+        uint64_t input_arrival = 0;
         
-        pthread_mutex_lock(&session->session_mutex);
+        session_lock(&session->session_mutex);
         bool has_client = (session->active && !session->disconnected);
+        bool lost_client = session->disconnected;
         int client_fd = has_client ? session->req_pipe_fd : -1;
         pthread_mutex_unlock(&session->session_mutex);
 
-        if (pacman->n_moves == 0) {
+        // the update thread saw the client go away, don't fall back to the keyboard
+        if (lost_client) {
+            *retval = QUIT_GAME;
+            return NULL;
+        }
+
+        if (!pacman->script) {
             if (has_client && client_fd != -1) {
+                // a ghost can kill the pacman or another player end the round while the
+                // client is quiet, so the pipe is only checked once per tick of game time,
+                // the sleep above does the waiting and a restore or an interrupt ends it
+                struct pollfd ready = {client_fd, POLLIN, 0};
+                if (poll(&ready, 1, 0) <= 0) continue;
                 char op_code;
                 ssize_t bytes_read = read(client_fd, &op_code, 1);
                 
                 if (bytes_read <= 0) {
-                   pthread_mutex_lock(&session->session_mutex);
+                   session_lock(&session->session_mutex);
                    session->disconnected = true;
                    pthread_mutex_unlock(&session->session_mutex);
                    *retval = QUIT_GAME;
-                   return (void*) retval;
+                   return NULL;
                 }
                 
                 if (op_code == OP_CODE_PLAY) {
                     char command_char;
                     ssize_t cmd_read = read(client_fd, &command_char, 1);
                     if (cmd_read <= 0) {
-                        pthread_mutex_lock(&session->session_mutex);
+                        session_lock(&session->session_mutex);
                         session->disconnected = true;
                         pthread_mutex_unlock(&session->session_mutex);
                         *retval = QUIT_GAME;
-                        return (void*) retval;
+                        return NULL;
                     }
+                    input_arrival = monotonic_ns();
+                    stats_add(STAT_COMMANDS_RECEIVED, 1);
                     c.command = command_char;
                     c.turns = 1;
                     play = &c;
                 } else if (op_code == OP_CODE_DISCONNECT) {
-                     pthread_mutex_lock(&session->session_mutex);
+                     session_lock(&session->session_mutex);
                      session->disconnected = true;
                      pthread_mutex_unlock(&session->session_mutex);
                      *retval = QUIT_GAME;
-                     return (void*) retval;
+                     return NULL;
                 } else {
                     continue; 
                 }
@@ -216,16 +349,36 @@ void* pacman_thread(void *arg) {
                 play = &c;
             }
         } else {
-            play = &pacman->moves[pacman->current_move % pacman->n_moves];
+            // a checkpoint restore rewrites pc and loops under the write lock
+            state_rdlock(&board->state_lock);
+            play = script_next(pacman->script, &pacman->pc, &pacman->loops);
+            pthread_rwlock_unlock(&board->state_lock);
         }
 
         if (play->command == 'Q') {
             *retval = QUIT_GAME;
-            return (void*) retval;
+            return NULL;
+        }
+
+        // 'G' saves the game, the next death goes back to this point
+        if (play->command == 'G') {
+            state_wrlock(&board->state_lock);
+            if (pacman->script) pacman->pc++;
+            checkpoint_save(checkpoint, board);
+            pthread_rwlock_unlock(&board->state_lock);
+            continue;
         }
 
-        pthread_rwlock_rdlock(&board->state_lock);
-        int result = move_pacman(board, 0, play);
+        uint64_t tick = trace_begin();
+        state_rdlock(&board->state_lock);
+        int result = move_pacman(board, index, play);
+        trace_end("pacman_tick", session->id, tick);
+        stats_add(STAT_PACMAN_TICKS, 1);
+        // only this thread changes the points
+        if (pacman->points != last_points) {
+            last_points = pacman->points;
+            leaderboard_update(session->slot, session->id, last_points);
+        }
         if (result == REACHED_PORTAL) {
             *retval = NEXT_LEVEL;
             pthread_rwlock_unlock(&board->state_lock); 
@@ -237,211 +390,614 @@ void* pacman_thread(void *arg) {
             break;
         }
         pthread_rwlock_unlock(&board->state_lock);
+
+        // the move is on the board now, the next encoded frame shows it
+        if (input_arrival != 0) {
+            session_lock(&session->session_mutex);
+            if (session->n_pending_inputs < MAX_PENDING_INPUTS) {
+                session->pending_inputs[session->n_pending_inputs++] = input_arrival;
+            }
+            pthread_mutex_unlock(&session->session_mutex);
+        }
+
+        // a crash loses at most snapshot_every() ticks of this session
+        if (snapshot && ++ticks % snapshot_every() == 0) {
+            state_wrlock(&board->state_lock);
+            snapshot_save(snapshot, board);
+            pthread_rwlock_unlock(&board->state_lock);
+        }
     }
-    return (void*) retval;
+    return NULL;
 }
 
 void* ghost_thread(void *arg) {
     ghost_thread_arg_t *ghost_arg = (ghost_thread_arg_t*) arg;
     board_t *board = ghost_arg->board;
+    session_t *session = ghost_arg->session;
     int ghost_ind = ghost_arg->ghost_index;
-    free(ghost_arg);
+    trace_thread_name("ghost");
 
     ghost_t* ghost = &board->ghosts[ghost_ind];
 
     while (true) {
-        sleep_ms(board->tempo * (1 + ghost->passo));
+        if (vclock_sleep_interruptible_ms(board->tempo * (1 + ghost->passo), ghost_arg->round_end)) return NULL;
 
-        pthread_rwlock_rdlock(&board->state_lock);
+        uint64_t tick = trace_begin();
+        state_rdlock(&board->state_lock);
         if (board->thread_shutdown) { 
             pthread_rwlock_unlock(&board->state_lock);
-            pthread_exit(NULL);
+            return NULL;
         }
         
-        move_ghost(board, ghost_ind, &ghost->moves[ghost->current_move % ghost->n_moves]);
+        // the index never lets in a ghost without moves, it just stands still if one gets through
+        if (ghost->script) move_ghost(board, ghost_ind, script_next(ghost->script, &ghost->pc, &ghost->loops));
+        stats_add(STAT_GHOST_TICKS, 1);
         pthread_rwlock_unlock(&board->state_lock);
+        trace_end("ghost_tick", session->id, tick);
     }
 }
 
-void* board_update_thread(void *arg) {
-    session_t *session = (session_t*) arg;
-    board_t *board = session->board;
-
-    while (true) {
-        sleep_ms(board->tempo); 
-
-        pthread_mutex_lock(&session->session_mutex);
-        int fd = session->notif_pipe_fd;
-        bool active = session->active && !session->disconnected;
-        pthread_mutex_unlock(&session->session_mutex);
+// A band of rows of the frame, the bands of a board are the same every tick
+static void encode_band(void *arg, int shard, int n_shards) {
+    frame_job_t *job = (frame_job_t*) arg;
+    int height = job->board->height;
+    board_to_string_rows(job->board, job->output, height * shard / n_shards, height * (shard + 1) / n_shards);
+}
 
-        if (!active || fd == -1) break; 
+void* board_update_thread(void *arg) {
+    board_update_arg_t *update_arg = (board_update_arg_t*) arg;
+    board_t *board = update_arg->board;
+    session_t **players = update_arg->players;
+    int n_players = update_arg->n_players;
+    const char *room_id = players[0]->id;
+    trace_thread_name("board_update");
+
+    // the board is encoded once per tick for the whole room, each player and its
+    // spectators get the same bytes with only their own pacman in the header
+    int header[6];
+    size_t frame_size = 1 + sizeof(header) + board->width * board->height;
+    if (update_arg->frame_capacity < frame_size) {
+        free(update_arg->frame);
+        update_arg->frame = malloc(frame_size);
+        update_arg->frame_capacity = frame_size;
+    }
+    char *frame = update_arg->frame;
+    shard_pool_t *shards = NULL;
+    if (frame_shards > 1 && (long) board->width * board->height >= SHARD_MIN_CELLS) {
+        if (!update_arg->shards) update_arg->shards = shard_pool_create(frame_shards);
+        shards = update_arg->shards;
+    }
+    frame_job_t job = {board, frame + 1 + sizeof(header)};
+
+    // players still getting frames, a dead or lost one is dropped from the stream
+    bool watching[MAX_ROOM_PLAYERS];
+    int n_watching = n_players;
+    for (int p = 0; p < n_players; p++) watching[p] = true;
+    int game_over[MAX_ROOM_PLAYERS];
+    int points[MAX_ROOM_PLAYERS];
+    uint64_t inputs[MAX_ROOM_PLAYERS][MAX_PENDING_INPUTS];
+    int n_inputs[MAX_ROOM_PLAYERS];
+
+    while (n_watching > 0) {
+        if (vclock_sleep_interruptible_ms(board->tempo, update_arg->round_end)) break;
+
+        // plays taken here were applied before this frame is encoded
+        for (int p = 0; p < n_players; p++) {
+            if (!watching[p]) continue;
+            session_t *session = players[p];
+            session_lock(&session->session_mutex);
+            bool active = session->active && !session->disconnected && session->notif_pipe_fd != -1;
+            n_inputs[p] = session->n_pending_inputs;
+            memcpy(inputs[p], session->pending_inputs, n_inputs[p] * sizeof(uint64_t));
+            session->n_pending_inputs = 0;
+            pthread_mutex_unlock(&session->session_mutex);
+            if (!active) {
+                watching[p] = false;
+                n_watching--;
+            }
+        }
+        if (n_watching == 0) break;
 
-        pthread_rwlock_rdlock(&board->state_lock);
+        state_rdlock(&board->state_lock);
         if (board->thread_shutdown) {
             pthread_rwlock_unlock(&board->state_lock);
             break;
         }
 
-        char op_code = OP_CODE_BOARD;
-        int header[6];
+        bool saved = update_arg->checkpoint && update_arg->checkpoint->saved;
+        for (int p = 0; p < n_players; p++) {
+            game_over[p] = !board->pacmans[p].alive && !saved;
+            points[p] = board->pacmans[p].points;
+        }
         header[0] = board->width;
         header[1] = board->height;
         header[2] = board->tempo;
         header[3] = 0;
-        if(!board->pacmans[0].alive){
-          header[4] = 1;
-        }else{
-          header[4] = 0;
-        }
-        header[5] = board->pacmans[0].points;
 
-        char *map_data = board_to_string(board);
-        int map_size = header[0] * header[1];
+        frame[0] = OP_CODE_BOARD;
+        uint64_t encode = trace_begin();
+        // the shards only read the board, the read lock held here covers them too
+        shard_run(shards, encode_band, &job);
+        trace_end("frame_encode", room_id, encode);
         
         pthread_rwlock_unlock(&board->state_lock);
 
-        pthread_mutex_lock(&session->session_mutex);
-        if (write_all(fd, &op_code, 1) == 0) {
-            if (write_all(fd, header, sizeof(header)) == 0) {
-                write_all(fd, map_data, map_size);
-            }
-        } else {
+        for (int p = 0; p < n_players; p++) {
+            if (!watching[p]) continue;
+            session_t *session = players[p];
+            header[4] = game_over[p];
+            header[5] = points[p];
+            memcpy(frame + 1, header, sizeof(header));
+
+            size_t sent = 0;
+            bool lost = false;
+            uint64_t write_start = trace_begin();
+            session_lock(&session->session_mutex);
+            if (write_all(session->notif_pipe_fd, frame, frame_size) != 0) {
                 session->disconnected = true;
+                lost = true;
+            } else {
+                sent = frame_size;
+                stats_add(STAT_FRAMES_SENT, 1);
+                atomic_fetch_add_explicit(&session->frames_sent, 1, memory_order_relaxed);
+            }
+            sent += broadcast_frame(session, frame, frame_size);
+            pthread_mutex_unlock(&session->session_mutex);
+            trace_end("frame_write", session->id, write_start);
+            // the pacman may be in the middle of a long sleep
+            if (lost) vclock_interrupt(&session->round_end);
+
+            stats_add(STAT_BYTES_WRITTEN, sent);
+            atomic_fetch_add_explicit(&session->bytes_written, sent, memory_order_relaxed);
+
+            uint64_t written = monotonic_ns();
+            for (int i = 0; i < n_inputs[p]; i++) {
+                histogram_record(&session->input_latency, written - inputs[p][i]);
+            }
+
+            if (lost || game_over[p]) {
+                watching[p] = false;
+                n_watching--;
+            }
         }
-        pthread_mutex_unlock(&session->session_mutex);
+    }
+    return NULL;
+}
 
-        free(map_data);
-        
-        if (header[4]) break;
+// A level with everything it needs before its threads start, loaded off the game threads
+typedef struct {
+    board_t board;
+    board_checkpoint_t checkpoint;
+    bool loaded;
+    const board_t *level; // as the session's index read it
+    int n_players; // pacmans the level gets, one per player of the room
+    session_t *session;
+    pool_t *pool; // the worker's, the preload thread allocates from it too
+} level_slot_t;
+
+static void free_level_slot(level_slot_t *slot) {
+    if (!slot->loaded) return;
+    checkpoint_free(&slot->checkpoint);
+    unload_level(&slot->board);
+    slot->loaded = false;
+}
+
+// Unloads the level the slot held before, the session is done with it
+static void prepare_level_slot(level_slot_t *slot) {
+    free_level_slot(slot);
+    memset(&slot->board, 0, sizeof(slot->board));
+    if (clone_level(&slot->board, slot->level, 0) != 0) return;
+    if (spawn_pacmans(&slot->board, slot->n_players) != 0) {
+        unload_level(&slot->board);
+        return;
     }
+    checkpoint_init(&slot->checkpoint, &slot->board);
+    stats_add(STAT_LEVEL_LOADS, 1);
+    slot->loaded = true;
+}
+
+static void* preload_thread(void *arg) {
+    level_slot_t *slot = (level_slot_t*) arg;
+    trace_thread_name("preload");
+    pool_use(slot->pool);
+    uint64_t start = trace_begin();
+    prepare_level_slot(slot);
+    trace_end("level_preload", slot->session->id, start);
     return NULL;
 }
 
-void *game_session(void *arg){
-    session_t *my_session = (session_t *) arg;
+typedef enum {
+    CREW_PACMAN,
+    CREW_GHOST,
+    CREW_UPDATE,
+} crew_role_t;
 
-    int accumulated_points = 0;
-    bool end_game = false;
-    board_t game_board;
-    game_board.thread_shutdown = 0;
+typedef struct crew crew_t;
+
+typedef struct {
+    crew_t *crew;
+    crew_role_t role;
+    int index; // of the pacman or ghost it plays
+    bool started;
+    unsigned seen; // last round this thread looked at
+    pthread_t tid;
+} crew_member_t;
+
+// The pacman, ghost and update threads of a session worker. A thread is created the
+// first time a level needs it and then waits for the next round instead of exiting,
+// so a new level or a checkpoint restore only hands the crew new arguments.
+// A room has one pacman thread per player and still a single update thread.
+struct crew {
+    pthread_mutex_t mutex;
+    pthread_cond_t start; // a round begins
+    pthread_cond_t done; // a member finished its part of the round
+    unsigned round;
+    int running; // members still playing the round
+    int pacmans_running;
+    bool round_over; // a pacman reached the portal or none is left playing
+    int n_pacmans;
+    int n_ghosts;
+    bool plays[MAX_ROOM_PLAYERS]; // pacmans with a player this round
+    bool has_viewers;
+    vclock_interrupt_t round_end; // ghosts and the update thread, each pacman sleeps on its player's
+    pacman_thread_arg_t pacman_args[MAX_ROOM_PLAYERS];
+    ghost_thread_arg_t ghost_args[MAX_GHOSTS];
+    board_update_arg_t update_arg;
+    crew_member_t pacmans[MAX_ROOM_PLAYERS];
+    crew_member_t update;
+    crew_member_t ghosts[MAX_GHOSTS];
+};
 
-    int index = -1;
+static bool crew_plays(crew_t *crew, crew_member_t *member) {
+    if (member->role == CREW_PACMAN) return member->index < crew->n_pacmans && crew->plays[member->index];
+    if (member->role == CREW_UPDATE) return crew->has_viewers;
+    return member->index < crew->n_ghosts;
+}
 
-    pthread_mutex_lock(&active_sessions_mutex);
-    for(int i = 0; i < MAX_SESSIONS_BUFFER; i++){
-        if(!active_sessions[i]){
-            index = i;
-            active_sessions[i] = my_session;
-            break;
+// A player who quits or loses the client in a room is out, the others play on
+static void leave_room(board_t *board, session_t *session, int index) {
+    session_lock(&session->session_mutex);
+    session->disconnected = true;
+    pthread_mutex_unlock(&session->session_mutex);
+
+    state_wrlock(&board->state_lock);
+    if (board->pacmans[index].alive) kill_pacman(board, index);
+    pthread_rwlock_unlock(&board->state_lock);
+}
+
+// Must be called with the crew mutex held
+static void crew_pacman_done(crew_t *crew, int index) {
+    crew->pacmans_running--;
+    if (crew->pacman_args[index].result == NEXT_LEVEL || crew->pacmans_running == 0) crew->round_over = true;
+}
+
+static void* crew_thread(void *arg) {
+    crew_member_t *member = (crew_member_t*) arg;
+    crew_t *crew = member->crew;
+
+    pthread_mutex_lock(&crew->mutex);
+    while (true) {
+        while (member->seen == crew->round) pthread_cond_wait(&crew->start, &crew->mutex);
+        member->seen = crew->round;
+        if (!crew_plays(crew, member)) continue;
+        pthread_mutex_unlock(&crew->mutex);
+
+        if (member->role == CREW_PACMAN) {
+            pacman_thread_arg_t *pacman_arg = &crew->pacman_args[member->index];
+            pacman_thread(pacman_arg);
+            if (pacman_arg->result == QUIT_GAME && crew->n_pacmans > 1) {
+                leave_room(pacman_arg->board, pacman_arg->session, member->index);
+            }
         }
+        else if (member->role == CREW_UPDATE) board_update_thread(&crew->update_arg);
+        else ghost_thread(&crew->ghost_args[member->index]);
+        // waiting for the next round, a manual clock advance must not wait for this thread
+        vclock_idle();
+
+        pthread_mutex_lock(&crew->mutex);
+        if (member->role == CREW_PACMAN) crew_pacman_done(crew, member->index);
+        crew->running--;
+        pthread_cond_broadcast(&crew->done);
     }
+    return NULL;
+}
 
-    pthread_mutex_unlock(&active_sessions_mutex);
+static void crew_init(crew_t *crew) {
+    memset(crew, 0, sizeof(crew_t));
+    pthread_mutex_init(&crew->mutex, NULL);
+    pthread_cond_init(&crew->start, NULL);
+    pthread_cond_init(&crew->done, NULL);
+    vclock_interrupt_init(&crew->round_end);
+    crew->update = (crew_member_t) {crew, CREW_UPDATE, 0, false, 0, 0};
+    for (int i = 0; i < MAX_ROOM_PLAYERS; i++) crew->pacmans[i] = (crew_member_t) {crew, CREW_PACMAN, i, false, 0, 0};
+    for (int i = 0; i < MAX_GHOSTS; i++) crew->ghosts[i] = (crew_member_t) {crew, CREW_GHOST, i, false, 0, 0};
+}
 
-    DIR* level_dir = opendir(global_level_dir);
-    
-    if (level_dir == NULL) {
-        pthread_mutex_lock(&my_session->session_mutex);
-        my_session->active = false;
-        my_session->disconnected = true;
-        pthread_mutex_unlock(&my_session->session_mutex);
-        
-        sem_post(&max_sessions_sem);
-        return NULL;
+// Must be called with the crew mutex held
+static void crew_spawn(crew_t *crew, crew_member_t *member) {
+    if (member->started) return;
+    // created in the middle of the round it has to play
+    member->seen = crew->round - 1;
+    if (pthread_create(&member->tid, NULL, crew_thread, member) == 0) {
+        member->started = true;
+        stats_add(STAT_ENTITY_THREADS_SPAWNED, 1);
+        return;
+    }
+    crew->running--;
+    if (member->role == CREW_PACMAN) {
+        crew->pacman_args[member->index].result = QUIT_GAME;
+        crew_pacman_done(crew, member->index);
     }
+}
 
-    struct dirent* entry;
-    while ((entry = readdir(level_dir)) != NULL && !end_game) {
-        if (entry->d_name[0] == '.') continue;
-        char *dot = strrchr(entry->d_name, '.');
-        if (!dot || strcmp(dot, ".lvl") != 0) continue;
+// Plays one round of the level on the board, until a pacman clears it or none is left
+static void crew_start(crew_t *crew, board_t *board, session_t **players, int n_players,
+                       board_checkpoint_t *checkpoint, snapshot_t *snapshot) {
+    pthread_mutex_lock(&crew->mutex);
+    crew->n_pacmans = n_players;
+    crew->pacmans_running = 0;
+    crew->has_viewers = false;
+    for (int p = 0; p < n_players; p++) {
+        session_lock(&players[p]->session_mutex);
+        bool connected = players[p]->active && !players[p]->disconnected;
+        pthread_mutex_unlock(&players[p]->session_mutex);
+
+        // alone the pacman always plays, the keyboard takes over without a client
+        crew->plays[p] = n_players == 1 || (connected && board->pacmans[p].alive);
+        crew->has_viewers |= connected;
+        if (crew->plays[p]) crew->pacmans_running++;
+        crew->pacman_args[p] = (pacman_thread_arg_t) {board, players[p], checkpoint, snapshot, p, CONTINUE_PLAY};
+        vclock_interrupt_reset(&players[p]->round_end);
+    }
+    for (int i = 0; i < board->n_ghosts; i++) {
+        crew->ghost_args[i] = (ghost_thread_arg_t) {board, players[0], &crew->round_end, i};
+    }
+    crew->update_arg.board = board;
+    crew->update_arg.players = players;
+    crew->update_arg.n_players = n_players;
+    crew->update_arg.checkpoint = checkpoint;
+    crew->update_arg.round_end = &crew->round_end;
+    crew->n_ghosts = board->n_ghosts;
+    crew->running = crew->pacmans_running + board->n_ghosts + (crew->has_viewers ? 1 : 0);
+    crew->round_over = crew->pacmans_running == 0;
+    crew->round++;
+    vclock_interrupt_reset(&crew->round_end);
+
+    for (int p = 0; p < n_players; p++) {
+        if (crew->plays[p]) crew_spawn(crew, &crew->pacmans[p]);
+    }
+    if (crew->has_viewers) crew_spawn(crew, &crew->update);
+    for (int i = 0; i < board->n_ghosts; i++) crew_spawn(crew, &crew->ghosts[i]);
+    pthread_cond_broadcast(&crew->start);
+    pthread_mutex_unlock(&crew->mutex);
+}
 
-        load_level(&game_board, entry->d_name, global_level_dir, accumulated_points);
-        
-        pthread_mutex_lock(&my_session->session_mutex);
-        my_session->board = &game_board;
-        pthread_mutex_unlock(&my_session->session_mutex);
+// Waits for the round to be decided, stops everyone and returns what ended it:
+// the portal if any pacman got there, else a death if any pacman died
+static int crew_finish(crew_t *crew, board_t *board) {
+    pthread_mutex_lock(&crew->mutex);
+    while (!crew->round_over) pthread_cond_wait(&crew->done, &crew->mutex);
+    pthread_mutex_unlock(&crew->mutex);
+
+    const char *room_id = crew->pacman_args[0].session->id;
+    uint64_t teardown = trace_begin();
+    state_wrlock(&board->state_lock);
+    board->thread_shutdown = 1;
+    pthread_rwlock_unlock(&board->state_lock);
+    // the others stop now, not when their tick comes
+    vclock_interrupt(&crew->round_end);
+    for (int p = 0; p < crew->n_pacmans; p++) vclock_interrupt(&crew->pacman_args[p].session->round_end);
+
+    pthread_mutex_lock(&crew->mutex);
+    while (crew->running > 0) pthread_cond_wait(&crew->done, &crew->mutex);
+    int result = QUIT_GAME;
+    for (int p = 0; p < crew->n_pacmans; p++) {
+        if (!crew->plays[p]) continue;
+        int played = crew->pacman_args[p].result;
+        if (played == NEXT_LEVEL) result = NEXT_LEVEL;
+        else if (played == LOAD_BACKUP && result != NEXT_LEVEL) result = LOAD_BACKUP;
+    }
+    pthread_mutex_unlock(&crew->mutex);
+    trace_end("round_teardown", room_id, teardown);
+    return result;
+}
 
-        while(true) {
-            pthread_t pacman_tid;
-            pthread_t *ghost_tids = malloc(game_board.n_ghosts * sizeof(pthread_t));
-            pthread_t board_update_tid = 0;
-
-            game_board.thread_shutdown = 0;
-            
-            pthread_mutex_lock(&my_session->session_mutex);
-            bool has_client = (my_session->active && !my_session->disconnected);
-            if (has_client) {
-                pthread_create(&board_update_tid, NULL, board_update_thread, my_session);
-            }
-            pthread_mutex_unlock(&my_session->session_mutex);
-
-            pacman_thread_arg_t *pacman_arg = malloc(sizeof(pacman_thread_arg_t));
-            pacman_arg->board = &game_board;
-            pacman_arg->session = my_session;
-            
-            pthread_create(&pacman_tid, NULL, pacman_thread, (void*) pacman_arg);
-            
-            for (int i = 0; i < game_board.n_ghosts; i++) {
-                ghost_thread_arg_t *arg = malloc(sizeof(ghost_thread_arg_t));
-                arg->board = &game_board;
-                arg->ghost_index = i;
-                pthread_create(&ghost_tids[i], NULL, ghost_thread, (void*) arg);
-            }
+// The pacmans of players that left give their cells back. Returns how many are still connected
+static int drop_lost_players(board_t *board, session_t **players, int n_players) {
+    int connected = 0;
+    for (int p = 0; p < n_players; p++) {
+        session_lock(&players[p]->session_mutex);
+        bool gone = players[p]->disconnected;
+        pthread_mutex_unlock(&players[p]->session_mutex);
+        if (!gone) connected++;
+        else if (n_players > 1 && board->pacmans[p].alive) kill_pacman(board, p);
+    }
+    return connected;
+}
+
+// Plays the levels for a room of players sharing one board, a single player is a room of one
+static void game_session(session_t **players, int n_players, crew_t *crew) {
+    session_t *my_session = players[0]; // names the room in traces and logs
+    uint64_t session_start = trace_begin();
+    uint64_t started = monotonic_ns();
+    int levels_cleared = 0;
+    int final_points[MAX_ROOM_PLAYERS] = {0};
+    int accumulated_points[MAX_ROOM_PLAYERS] = {0};
+    char last_level[sizeof(((board_t*) 0)->level_name)] = "";
 
-            int *retval;
-            pthread_join(pacman_tid, (void**)&retval);
+    bool end_game = false;
+
+    // max_sessions_sem never lets in more players than there are slots
+    pthread_mutex_lock(&active_sessions_mutex);
+    for (int p = 0, i = 0; p < n_players; p++) {
+        while (active_sessions[i]) i++;
+        active_sessions[i] = players[p];
+        players[p]->slot = i;
+    }
+    pthread_mutex_unlock(&active_sessions_mutex);
+    stats_add(STAT_SESSIONS_STARTED, n_players);
+    if (n_players > 1) log_info("[%s] Room of %d players\n", my_session->id, n_players);
+
+    // the session plays the levels indexed when it started, even if they change meanwhile
+    levelindex_t *levels = levelindex_acquire();
+    int first_level = 0;
+
+    // a snapshot left behind by a crash sends the session back to the level it was on.
+    // Rooms don't keep one, the other players would not be the same after a restart
+    snapshot_t *snapshot = n_players == 1 ? snapshot_open(my_session->id) : NULL;
+    char resume_level[sizeof(last_level)] = "";
+    if (snapshot && snapshot_pending(snapshot, resume_level, sizeof(resume_level), &levels_cleared) == 0) {
+        first_level = levelindex_find(levels, resume_level);
+        if (first_level >= 0) {
+            log_info("[%s] Resuming on %s\n", my_session->id, resume_level);
+        } else {
+            first_level = 0;
+            resume_level[0] = '\0';
+            levels_cleared = 0;
+        }
+    }
 
-            pthread_rwlock_wrlock(&game_board.state_lock);
-            game_board.thread_shutdown = 1; 
-            pthread_rwlock_unlock(&game_board.state_lock);
+    // the level being played and the next one, loaded in the background meanwhile
+    level_slot_t slots[2];
+    memset(slots, 0, sizeof(slots));
+    int current = 0;
+    pthread_t preload_tid;
+    bool preloading = false;
+
+    for (int level = first_level; level < levels->n_levels && !end_game; level++) {
+        uint64_t load_start = trace_begin();
+        level_slot_t *slot = &slots[current];
+        if (preloading) {
+            // normally done long before the portal, the transition is just a swap of boards
+            pthread_join(preload_tid, NULL);
+            preloading = false;
+        } else {
+            slot->level = &levels->levels[level];
+            slot->n_players = n_players;
+            prepare_level_slot(slot);
+        }
+        if (!slot->loaded) {
+            // out of memory, or no room for every player
+            log_warn("[%s] Could not load %s\n", my_session->id, levels->names[level]);
+            continue;
+        }
 
-            if (board_update_tid != 0) {
-                pthread_join(board_update_tid, NULL);
+        board_t *game_board = &slot->board;
+        board_checkpoint_t *checkpoint = &slot->checkpoint;
+        for (int p = 0; p < n_players; p++) game_board->pacmans[p].points = accumulated_points[p];
+        if (resume_level[0] != '\0') {
+            if (snapshot_restore(snapshot, game_board) == 0) stats_add(STAT_SESSIONS_RESUMED, 1);
+            resume_level[0] = '\0';
+        }
+        if (snapshot) snapshot_begin_level(snapshot, game_board, levels_cleared);
+        trace_end("level_load", my_session->id, load_start);
+        for (int p = 0; p < n_players; p++) {
+            leaderboard_update(players[p]->slot, players[p]->id, game_board->pacmans[p].points);
+            session_lock(&players[p]->session_mutex);
+            players[p]->board = game_board;
+            pthread_mutex_unlock(&players[p]->session_mutex);
+        }
+
+        // the other slot holds the previous level, the crew is done with it
+        if (level + 1 < levels->n_levels) {
+            level_slot_t *next = &slots[1 - current];
+            next->level = &levels->levels[level + 1];
+            next->n_players = n_players;
+            next->session = my_session;
+            next->pool = pool_current();
+            preloading = pthread_create(&preload_tid, NULL, preload_thread, next) == 0;
+        }
+
+        while(true) {
+            game_board->thread_shutdown = 0;
+            if (drop_lost_players(game_board, players, n_players) == 0 && n_players > 1) {
+                end_game = true;
+                break;
             }
 
-            for (int i = 0; i < game_board.n_ghosts; i++) pthread_join(ghost_tids[i], NULL);
-            free(ghost_tids);
+            crew_start(crew, game_board, players, n_players, checkpoint, snapshot);
+            int result = crew_finish(crew, game_board);
+
+            // a room plays on while anyone is still there
+            if (drop_lost_players(game_board, players, n_players) == 0) end_game = true;
 
-            int result = *retval;
-            free(retval);
+            if (result == NEXT_LEVEL) levels_cleared++;
 
-            pthread_mutex_lock(&my_session->session_mutex);
-            if(my_session->disconnected) end_game = true;
-            pthread_mutex_unlock(&my_session->session_mutex);
+            // the whole crew is waiting for the next round, the board can be rolled back
+            if (result == LOAD_BACKUP && !end_game && checkpoint_restore(checkpoint, game_board) == 0) {
+                debug("[%s] Restored checkpoint\n", my_session->id);
+                stats_add(STAT_CHECKPOINT_RESTORES, 1);
+                for (int p = 0; p < n_players; p++) {
+                    leaderboard_update(players[p]->slot, players[p]->id, game_board->pacmans[p].points);
+                }
+                if (snapshot) snapshot_save(snapshot, game_board);
+                continue;
+            }
 
             if(result == NEXT_LEVEL && !end_game) {
-                accumulated_points = game_board.pacmans[0].points;      
+                for (int p = 0; p < n_players; p++) accumulated_points[p] = game_board->pacmans[p].points;
                 break; 
             } else {
                 end_game = true; 
                 break;
             }
-            accumulated_points = game_board.pacmans[0].points;      
         }
-        print_board(&game_board);
-        unload_level(&game_board);
+        for (int p = 0; p < n_players; p++) final_points[p] = game_board->pacmans[p].points;
+        strcpy(last_level, game_board->level_name);
+        print_board(game_board);
+        // the next preload into this slot unloads it
+        current = 1 - current;
         if(end_game) break;
     }
-    
-    closedir(level_dir); 
 
-    pthread_mutex_lock(&active_sessions_mutex);
-    active_sessions[index] = NULL;
-    pthread_mutex_unlock(&active_sessions_mutex);
+    if (preloading) pthread_join(preload_tid, NULL);
+    for (int p = 0; p < n_players; p++) {
+        session_lock(&players[p]->session_mutex);
+        players[p]->board = NULL;
+        pthread_mutex_unlock(&players[p]->session_mutex);
+    }
+    free_level_slot(&slots[0]);
+    free_level_slot(&slots[1]);
+    levelindex_release(levels);
+
+    // the game is over, nothing left to resume
+    snapshot_close(snapshot, true);
+    uint64_t elapsed_ms = (monotonic_ns() - started) / 1000000;
+    for (int p = 0; p < n_players; p++) {
+        session_t *player = players[p];
+        leaderboard_remove(player->slot);
+        if (last_level[0] != '\0') {
+            scorelog_append(player->id, last_level, final_points[p], levels_cleared, elapsed_ms);
+        }
+        pthread_mutex_lock(&active_sessions_mutex);
+        active_sessions[player->slot] = NULL;
+        pthread_mutex_unlock(&active_sessions_mutex);
+
+        session_lock(&player->session_mutex);
+        if (player->req_pipe_fd != -1) close(player->req_pipe_fd);
+        if (player->notif_pipe_fd != -1) close(player->notif_pipe_fd);
+        close_spectators(player);
+        player->active = false;
+        player->disconnected = true;
+        pthread_mutex_unlock(&player->session_mutex);
+
+        stats_add(STAT_SESSIONS_ENDED, 1);
+        sem_post(&max_sessions_sem);
+    }
+    trace_end("session", my_session->id, session_start);
+}    
 
-    pthread_mutex_lock(&my_session->session_mutex);
-    if (my_session->req_pipe_fd != -1) close(my_session->req_pipe_fd);
-    if (my_session->notif_pipe_fd != -1) close(my_session->notif_pipe_fd);
-    my_session->active = false;
-    my_session->disconnected = true;
-    pthread_mutex_unlock(&my_session->session_mutex);
+static session_t* dequeue_session() {
+    pthread_mutex_lock(&buffer_mutex);
     
-    sem_post(&max_sessions_sem);
+    session_t *session = session_buffer[buffer_tail];
+    buffer_tail = (buffer_tail + 1) % MAX_SESSIONS_BUFFER;
 
-    return NULL;
-}    
+    pthread_mutex_unlock(&buffer_mutex);
+    stats_add(STAT_SESSIONS_DEQUEUED, 1);
+    sem_post(&buffer_empty); 
+    return session;
+}
 
 void* consumer_thread(void* arg){
     (void)arg; 
@@ -449,197 +1005,384 @@ void* consumer_thread(void* arg){
     sigemptyset(&set);
     sigaddset(&set, SIGUSR1);
     pthread_sigmask(SIG_BLOCK, &set, NULL);
+    trace_thread_name("session");
+    // every session this worker runs reuses the same level storage and entity threads
+    pool_use(pool_create());
+    crew_t crew;
+    crew_init(&crew);
+    session_t *players[MAX_ROOM_PLAYERS];
 
     while(true){
         sem_wait(&buffer_full);
-        pthread_mutex_lock(&buffer_mutex);
-        
-        session_t *session = session_buffer[buffer_tail];
-        buffer_tail = (buffer_tail + 1) % MAX_SESSIONS_BUFFER;
-
-        pthread_mutex_unlock(&buffer_mutex);
-        sem_post(&buffer_empty); 
+        int n_players = 0;
+        session_t *session = dequeue_session();
+        if (session != NULL) players[n_players++] = session;
+
+        // the first player waits a bounded time for the room to fill, then plays with who came
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += room_wait_ms / 1000;
+        deadline.tv_nsec += (room_wait_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (n_players > 0 && n_players < room_size && sem_timedwait(&buffer_full, &deadline) == 0) {
+            session = dequeue_session();
+            if (session != NULL) players[n_players++] = session;
+        }
 
-        if(session != NULL){
-            game_session(session);
-            free(session); 
+        if (n_players > 0) {
+            game_session(players, n_players, &crew);
+            for (int p = 0; p < n_players; p++) free(players[p]);
         }
     }
     return NULL;
 }
 
-int compare_scores(const void *a, const void *b){
-    player_score_t *player1 = (player_score_t *)a;
-    player_score_t *player2 = (player_score_t *)b;
-    return (player2->score - player1->score);
+// top5.txt is replaced atomically, readers never see a partial file
+static void write_top5(){
+    leaderboard_publish("top5.txt");
 }
 
-int get_points(player_score_t *scores_list){
-    int count = 0;
-
-    pthread_mutex_lock(&active_sessions_mutex);
+// One line per active session: input-to-frame latency percentiles in microseconds
+static void write_latency_report(){
+    int fd = open("latency.txt", O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return;
+    }
 
-    for(int i = 0; i < MAX_SESSIONS_BUFFER; i++){
-        if(active_sessions[i] && active_sessions[i]->active && active_sessions[i]->board){
-            char *start = active_sessions[i]->notif_pipe_path + 5;
-            char *underscore = strchr(start, '_');
-            size_t length;
-            length = underscore - start;
-            strncpy(scores_list[count].id, start, length);
-            scores_list[count].id[length] = '\0';
+    char line[256];
+    int len = snprintf(line, sizeof(line), "# id samples p50_us p99_us p999_us max_us\n");
+    write_all(fd, line, len);
 
-            scores_list[count].score = active_sessions[i]->board->pacmans[0].points;
-            count++;
-        }
+    pthread_mutex_lock(&active_sessions_mutex);
+    for (int i = 0; i < MAX_SESSIONS_BUFFER; i++) {
+        session_t *session = active_sessions[i];
+        if (!session || !session->active) continue;
+
+        histogram_t *hist = &session->input_latency;
+        len = snprintf(line, sizeof(line), "%s %llu %.1f %.1f %.1f %.1f\n", session->id,
+                       (unsigned long long) histogram_count(hist),
+                       histogram_percentile(hist, 50.0) / 1000.0,
+                       histogram_percentile(hist, 99.0) / 1000.0,
+                       histogram_percentile(hist, 99.9) / 1000.0,
+                       histogram_max(hist) / 1000.0);
+        write_all(fd, line, len);
     }
-
     pthread_mutex_unlock(&active_sessions_mutex);
 
-    if(count == 0){
-        return 0;
-    }
+    close(fd);
+}
 
-    int index = 5;
+// "/tmp/<id>_notification" -> "<id>"
+static void session_id_from_path(const char *notif_pipe, char *id) {
+    const char *start = strrchr(notif_pipe, '/');
+    start = start ? start + 1 : notif_pipe;
+    const char *underscore = strrchr(start, '_');
+    size_t length = underscore ? (size_t)(underscore - start) : strlen(start);
+    memcpy(id, start, length);
+    id[length] = '\0';
+}
 
-    if(count < 5){
-        index = count;
+// How long a spectator gets to open its pipe for reading
+#define SPECTATOR_OPEN_TIMEOUT_MS 5000
+#define SPECTATOR_OPEN_RETRY_MS 10
+
+// Attaches a read-only observer to the active session with the given id.
+// Spectators do not take a game slot and never get input back to the server.
+// Runs on its own thread: a spectator that never opens its pipe must not hold
+// up the registrations behind it.
+static void* spectator_thread(void *arg) {
+    char *request = (char*) arg;
+    char target[41] = {0};
+    char notif_pipe[41] = {0};
+    strncpy(target, &request[1], 40);
+    strncpy(notif_pipe, &request[41], 40);
+    free(request);
+
+    log_info("[INFO] Novo espectador: %s -> %s\n", notif_pipe, target);
+
+    // a slow spectator must never stall the frame writer, so the pipe is non-blocking
+    // from the start, and opening it fails with ENXIO until the reader is there
+    int notif_fd = -1;
+    uint64_t deadline = monotonic_ns() + (uint64_t) SPECTATOR_OPEN_TIMEOUT_MS * 1000000;
+    while ((notif_fd = open(notif_pipe, O_WRONLY | O_NONBLOCK)) == -1 &&
+           (errno == ENXIO || errno == EINTR) && monotonic_ns() < deadline) {
+        struct timespec retry = {0, SPECTATOR_OPEN_RETRY_MS * 1000000L};
+        nanosleep(&retry, NULL);
+    }
+    if (notif_fd == -1) {
+        log_info("[INFO] Espectador %s nunca abriu o pipe\n", notif_pipe);
+        return NULL;
     }
 
-    qsort(scores_list, count, sizeof(player_score_t), compare_scores);
+    char response[2] = {OP_CODE_SPECTATE, 1};
 
-    //for(int i = 0; i < index; i++){
-    //    printf("%s, %d\n", scores_list[i].id, scores_list[i].score);
-    //}
+    pthread_mutex_lock(&active_sessions_mutex);
+    for (int i = 0; i < MAX_SESSIONS_BUFFER; i++) {
+        session_t *session = active_sessions[i];
+        if (!session || strcmp(session->id, target) != 0) continue;
+
+        session_lock(&session->session_mutex);
+        if (session->active && session->n_spectators < MAX_SPECTATORS) {
+            response[1] = 0;
+            write(notif_fd, response, 2);
+            session->spectators[session->n_spectators++] = (spectator_t) {.fd = notif_fd};
+        }
+        pthread_mutex_unlock(&session->session_mutex);
+        break;
+    }
+    pthread_mutex_unlock(&active_sessions_mutex);
 
-    return index;
+    if (response[1] != 0) {
+        write(notif_fd, response, 2);
+        close(notif_fd);
+    }
+    return NULL;
 }
 
-
-static void write_top5(){
-
-
-    player_score_t player_scores[MAX_SESSIONS_BUFFER];
-    int index = get_points(player_scores);
-
-    int fd = open("top5.txt", O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
-    if (fd < 0) {
+static void accept_spectator(const char *request) {
+    char *copy = malloc(REGISTRATION_MSG_SIZE);
+    memcpy(copy, request, REGISTRATION_MSG_SIZE);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, spectator_thread, copy) != 0) {
+        free(copy);
         return;
     }
+    pthread_detach(tid);
+}
 
-    for(int i = 0; i < index; i++){
-
-        int score = player_scores[i].score;
-        char *id = player_scores[i].id;
+static session_t* accept_registration(const char *request) {
+    if (request[0] == OP_CODE_SPECTATE) {
+        accept_spectator(request);
+        return NULL;
+    }
+    if (request[0] != OP_CODE_CONNECT) return NULL;
 
-        //calcula tamanho do buffer
-        int score_len = snprintf(NULL, 0, "%d", score);
-        int id_len = strlen(id);
-        int buffer_size = id_len + 1 + score_len + 1 + 1;
-        char buffer[buffer_size];
+    char req_pipe[41] = {0};
+    char notif_pipe[41] = {0};
+    strncpy(req_pipe, &request[1], 40);
+    strncpy(notif_pipe, &request[41], 40);
 
+    log_info("[INFO] Novo cliente: %s\n", notif_pipe);
 
-        snprintf(buffer, buffer_size,"%s %d\n", player_scores[i].id, player_scores[i].score);
+    uint64_t wait_start = monotonic_ns();
+    if (sem_wait(&max_sessions_sem) != 0) return NULL;
+    stats_add(STAT_SLOT_WAITS, 1);
+    stats_add(STAT_SLOT_WAIT_NS, monotonic_ns() - wait_start);
 
-        int len = sizeof(buffer) - 1;
-        int done = 0;
+    int notif_fd = open(notif_pipe, O_WRONLY);
+    int req_fd = open(req_pipe, O_RDONLY);
 
-        while (len > done) {
-            int bytes_written = write(fd, buffer + done, len - done);
+    if (notif_fd == -1 || req_fd == -1) {
+        if (notif_fd != -1) close(notif_fd);
+        if (req_fd != -1) close(req_fd);
+        sem_post(&max_sessions_sem);
+        return NULL;
+    }
 
-            if (bytes_written < 0) {
-                return;
-            }
+    session_t *session = malloc(sizeof(session_t)); 
+    session->req_pipe_fd = req_fd;
+    session->notif_pipe_fd = notif_fd;
+    strncpy(session->notif_pipe_path, notif_pipe, MAX_PIPE_PATH_LENGTH);
+    strncpy(session->req_pipe_path, req_pipe, MAX_PIPE_PATH_LENGTH);
+    session_id_from_path(notif_pipe, session->id);
+    session->n_spectators = 0;
+    session->n_pending_inputs = 0;
+    histogram_init(&session->input_latency);
+    atomic_init(&session->frames_sent, 0);
+    atomic_init(&session->bytes_written, 0);
+    session->active = true;
+    session->disconnected = false;
+    session->board = NULL;
+    vclock_interrupt_init(&session->round_end);
+    pthread_mutex_init(&session->session_mutex, NULL);
+
+    char response[2] = {OP_CODE_CONNECT, 0};
+    write(notif_fd, response, 2);
+
+    return session;
+}
 
-            done += bytes_written;
-        }
+// Hands accepted sessions to the workers, one lock for the whole batch
+static void queue_sessions(session_t **batch, int n) {
+    for (int i = 0; i < n; i++) sem_wait(&buffer_empty);
+    pthread_mutex_lock(&buffer_mutex);
 
+    for (int i = 0; i < n; i++) {
+        session_buffer[buffer_head] = batch[i];
+        buffer_head = (buffer_head + 1) % MAX_SESSIONS_BUFFER;
     }
-    close(fd);
-    return;
+    
+    pthread_mutex_unlock(&buffer_mutex);
+    stats_add(STAT_SESSIONS_QUEUED, n);
+    for (int i = 0; i < n; i++) sem_post(&buffer_full); 
 }
 
 void* connection_handler_thread(void *arg) {
     char *registration_fifo = (char*) arg;
-    char buffer[81];
+    trace_thread_name("connection");
+    // room for a whole batch of requests plus a partial one left over from the previous read
+    char buffer[REGISTRATION_BATCH * REGISTRATION_MSG_SIZE];
+    size_t pending = 0;
 
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGQUIT);
-    sigaddset(&set, SIGINT);
     pthread_sigmask(SIG_BLOCK, &set, NULL);
+    // every other thread keeps them blocked, the stop is handled here
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    // O_RDWR keeps a writer on the FIFO, so read never sees EOF between clients
+    int rx = open(registration_fifo, O_RDWR);
+    if (rx == -1) {
+        log_error("[ERROR] Could not open registration fifo %s\n", registration_fifo);
+        return NULL;
+    }
 
     while (true) {
 
         if(got_sigusr1){
             write_top5();
+            scorelog_publish("alltime.txt");
+            write_latency_report();
+            lockprof_report("lockprof.txt");
+            trace_flush();
             got_sigusr1 = 0;
         }
-        int rx = open(registration_fifo, O_RDONLY);
 
-        if (rx == -1){
-            continue;
-        } 
- 
-        int n = read(rx, buffer, 81);
-        close(rx);
+        // the trace only lives in memory until flushed, then the default action ends the server
+        if (got_stop) {
+            int sig = got_stop;
+            log_info("[INFO] Sinal %d, a terminar\n", sig);
+            trace_flush();
+            signal(sig, SIG_DFL);
+            raise(sig);
+        }
 
-        if (n != 81 || buffer[0] != 1) continue;
+        ssize_t n = read(rx, buffer + pending, sizeof(buffer) - pending);
+        if (n <= 0) continue;
+        pending += n;
+
+        session_t *batch[REGISTRATION_BATCH];
+        int accepted = 0;
+        size_t records = pending / REGISTRATION_MSG_SIZE;
+
+        for (size_t i = 0; i < records; i++) {
+            const char *request = &buffer[i * REGISTRATION_MSG_SIZE];
+            // the sessions held here only give their slots back once a worker plays them,
+            // queue them before waiting for a slot or the wait never ends
+            int free_slots = 0;
+            if (request[0] == OP_CODE_CONNECT && accepted > 0 &&
+                sem_getvalue(&max_sessions_sem, &free_slots) == 0 && free_slots <= 0) {
+                queue_sessions(batch, accepted);
+                accepted = 0;
+            }
+            session_t *session = accept_registration(request);
+            if (session != NULL) batch[accepted++] = session;
+        }
 
-        char req_pipe[41] = {0};
-        char notif_pipe[41] = {0};
-        strncpy(req_pipe, &buffer[1], 40);
-        strncpy(notif_pipe, &buffer[41], 40);
+        pending -= records * REGISTRATION_MSG_SIZE;
+        memmove(buffer, &buffer[records * REGISTRATION_MSG_SIZE], pending);
+
+        if (accepted > 0) queue_sessions(batch, accepted);
+    }
+    close(rx);
+    return NULL;
+}
 
-        debug("[INFO] Novo cliente: %s\n", notif_pipe);
 
-        if (sem_wait(&max_sessions_sem) != 0) continue;
+// Every reader that opens the stats fifo gets one snapshot of the counters followed by EOF
+void* stats_thread(void *arg) {
+    char *stats_fifo = (char*) arg;
 
-        int notif_fd = open(notif_pipe, O_WRONLY);
-        int req_fd = open(req_pipe, O_RDONLY);
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-        if (notif_fd == -1 || req_fd == -1) {
-            if (notif_fd != -1) close(notif_fd);
-            if (req_fd != -1) close(req_fd);
-            sem_post(&max_sessions_sem);
-            continue;
+    while (true) {
+        // blocks until someone opens the fifo for reading
+        int fd = open(stats_fifo, O_WRONLY);
+        if (fd == -1) {
+            if (errno == EINTR) continue;
+            return NULL;
         }
 
-        session_t *session = malloc(sizeof(session_t)); 
-        session->req_pipe_fd = req_fd;
-        session->notif_pipe_fd = notif_fd;
-        strncpy(session->notif_pipe_path, notif_pipe, MAX_PIPE_PATH_LENGTH);
-        strncpy(session->req_pipe_path, req_pipe, MAX_PIPE_PATH_LENGTH);
-        session->active = true;
-        session->disconnected = false;
-        session->board = NULL;
-        pthread_mutex_init(&session->session_mutex, NULL);
+        char *snapshot = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&snapshot, &len);
+        stats_write(out);
+
+        fprintf(out, "# HELP pacman_session_frames_sent Frames written to one player\n"
+                     "# TYPE pacman_session_frames_sent counter\n");
+        pthread_mutex_lock(&active_sessions_mutex);
+        for (int i = 0; i < MAX_SESSIONS_BUFFER; i++) {
+            session_t *session = active_sessions[i];
+            if (!session) continue;
+            fprintf(out, "pacman_session_frames_sent{session=\"%s\"} %llu\n", session->id,
+                    (unsigned long long) atomic_load(&session->frames_sent));
+        }
+        fprintf(out, "# HELP pacman_session_bytes_written Frame bytes written for one session\n"
+                     "# TYPE pacman_session_bytes_written counter\n");
+        for (int i = 0; i < MAX_SESSIONS_BUFFER; i++) {
+            session_t *session = active_sessions[i];
+            if (!session) continue;
+            fprintf(out, "pacman_session_bytes_written{session=\"%s\"} %llu\n", session->id,
+                    (unsigned long long) atomic_load(&session->bytes_written));
+        }
+        pthread_mutex_unlock(&active_sessions_mutex);
 
-        char response[2] = {OP_CODE_CONNECT, 0};
-        write(notif_fd, response, 2);
+        fprintf(out, "# HELP pacman_log_dropped_total Log messages dropped because a ring was full\n"
+                     "# TYPE pacman_log_dropped_total counter\n"
+                     "pacman_log_dropped_total %llu\n", (unsigned long long) log_dropped());
 
-        sem_wait(&buffer_empty);
-        pthread_mutex_lock(&buffer_mutex);
+        fclose(out);
+        write_all(fd, snapshot, len);
+        free(snapshot);
+        close(fd);
 
-        session_buffer[buffer_head] = session;
-        buffer_head = (buffer_head + 1) % MAX_SESSIONS_BUFFER;
-        
-        pthread_mutex_unlock(&buffer_mutex);
-        sem_post(&buffer_full); 
+        // let the reader see EOF before the next open could find it still attached
+        sleep_ms(100);
     }
     return NULL;
 }
 
+// Manual clock: every line written to <registration_fifo>.clock advances game time by that many ms
+void* clock_thread(void *arg) {
+    char *clock_fifo = (char*) arg;
 
-static void sig_handler(int sig) {
-  if (sig == SIGUSR1) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-    if (signal(SIGUSR1, sig_handler) == SIG_ERR) {
-      exit(EXIT_FAILURE);
+    // O_RDWR keeps the fifo open between writers, like the registration fifo
+    int fd = open(clock_fifo, O_RDWR);
+    if (fd == -1) return NULL;
+
+    char line[MAX_COMMAND_LENGTH];
+    while (read_line(fd, line) >= 0) {
+        long step = atol(line);
+        if (step > 0) vclock_advance_ms(step);
     }
+    close(fd);
+    return NULL;
+}
 
+static void sig_handler(int sig) {
+  if (sig == SIGUSR1) {
     got_sigusr1 = 1;
     return;
   }
+  if (sig == SIGTERM || sig == SIGINT) {
+    got_stop = sig;
+    return;
+  }
 }
 
 
@@ -650,21 +1393,88 @@ int main(int argc, char** argv) {
         return -1;
     }
 
-    if (signal(SIGUSR1, sig_handler) == SIG_ERR) {
+    // no SA_RESTART: the signal has to interrupt the blocking read on the registration fifo
+    // so the dump happens right away instead of on the next connection
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sig_handler;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGUSR1, &action, NULL) != 0 || sigaction(SIGTERM, &action, NULL) != 0 ||
+        sigaction(SIGINT, &action, NULL) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    // only the connection thread takes a stop, every thread created from here on inherits this
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+
+    // a client closing its pipes must not kill the server, write_all reports it instead
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
         exit(EXIT_FAILURE);
     }
 
     global_level_dir = argv[1]; 
     server_max_games = atoi(argv[2]);
+    char *value = getenv("PACMAN_ROOM_SIZE");
+    if (value) room_size = atoi(value);
+    if (room_size < 1 || room_size > MAX_ROOM_PLAYERS) {
+        printf("PACMAN_ROOM_SIZE must be between 1 and %d\n", MAX_ROOM_PLAYERS);
+        return -1;
+    }
+    value = getenv("PACMAN_ROOM_WAIT_MS");
+    if (value) room_wait_ms = atoi(value) > 0 ? atoi(value) : 0;
+    // max_games workers * frame_shards threads at most, pays off only with cores to spare
+    value = getenv("PACMAN_FRAME_SHARDS");
+    if (value) frame_shards = atoi(value);
+    if (frame_shards < 1) frame_shards = 1;
+    if (frame_shards > MAX_SHARDS) frame_shards = MAX_SHARDS;
     char *fifo_name = argv[3];
     srand((unsigned int)time(NULL));
 
     if (unlink(fifo_name) != 0 && errno != ENOENT) return 0;
     if (mkfifo(fifo_name, 0666) != 0) return 0;
 
+    // counters are read from <registration_fifo>.stats
+    char stats_fifo[MAX_FILENAME];
+    snprintf(stats_fifo, sizeof(stats_fifo), "%s.stats", fifo_name);
+    if (unlink(stats_fifo) != 0 && errno != ENOENT) return 0;
+    if (mkfifo(stats_fifo, 0666) != 0) return 0;
+
     open_debug_file("debug.log");
+    trace_init();
+    if (vclock_init() != 0) {
+        printf("PACMAN_CLOCK must be real, scaled:<factor> or manual\n");
+        return -1;
+    }
+
+    char clock_fifo[MAX_FILENAME];
+    snprintf(clock_fifo, sizeof(clock_fifo), "%s.clock", fifo_name);
+    if (vclock_mode() == VCLOCK_MANUAL) {
+        if (unlink(clock_fifo) != 0 && errno != ENOENT) return 0;
+        if (mkfifo(clock_fifo, 0666) != 0) return 0;
+    }
 
-    sem_init(&max_sessions_sem, 0, server_max_games);
+    if (leaderboard_init(MAX_SESSIONS_BUFFER) != 0) return -1;
+    if (levelindex_init(global_level_dir) != 0) {
+        printf("Could not read the level directory %s\n", global_level_dir);
+        return -1;
+    }
+    if (snapshot_init() != 0) {
+        printf("Could not create the snapshot directory\n");
+        return -1;
+    }
+    // all-time scores survive restarts in scores.log / scores.snap
+    if (scorelog_open("scores") != 0) {
+        printf("Could not open the score log\n");
+        return -1;
+    }
+
+    // max_games counts boards, every one of them takes up to a room of players
+    int max_players = server_max_games * room_size;
+    if (max_players > MAX_SESSIONS_BUFFER) max_players = MAX_SESSIONS_BUFFER;
+    sem_init(&max_sessions_sem, 0, max_players);
     sem_init(&buffer_empty, 0, MAX_SESSIONS_BUFFER);
     sem_init(&buffer_full, 0, 0);
 
@@ -676,6 +1486,14 @@ int main(int argc, char** argv) {
     pthread_t connection_thread;
     pthread_create(&connection_thread, NULL, connection_handler_thread, fifo_name);
 
+    pthread_t stats_tid;
+    pthread_create(&stats_tid, NULL, stats_thread, stats_fifo);
+
+    if (vclock_mode() == VCLOCK_MANUAL) {
+        pthread_t clock_tid;
+        pthread_create(&clock_tid, NULL, clock_thread, clock_fifo);
+    }
+
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGUSR1);
@@ -683,6 +1501,7 @@ int main(int argc, char** argv) {
     
     pthread_join(connection_thread, NULL);
 
+    scorelog_close();
     close_debug_file();
     sem_destroy(&max_sessions_sem);
     sem_destroy(&buffer_full);
@@ -0,0 +1,70 @@
+#include "histogram.h"
+
+static int bucket_index(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) return (int) value;
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HIST_SUB_BITS;
+    // (value >> shift) is in [HIST_SUB_BUCKETS, 2 * HIST_SUB_BUCKETS)
+    return (shift + 1) * HIST_SUB_BUCKETS + (int)((value >> shift) - HIST_SUB_BUCKETS);
+}
+
+// Highest value that falls in the bucket
+static uint64_t bucket_value(int index) {
+    int magnitude = index / HIST_SUB_BUCKETS;
+    uint64_t sub = index % HIST_SUB_BUCKETS;
+
+    if (magnitude == 0) return sub;
+    int shift = magnitude - 1;
+    return ((HIST_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void histogram_init(histogram_t *hist) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        atomic_init(&hist->counts[i], 0);
+    }
+    atomic_init(&hist->total, 0);
+    atomic_init(&hist->max, 0);
+}
+
+void histogram_record(histogram_t *hist, uint64_t value) {
+    atomic_fetch_add_explicit(&hist->counts[bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->total, 1, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+    while (value > max &&
+           !atomic_compare_exchange_weak_explicit(&hist->max, &max, value,
+                                                  memory_order_relaxed, memory_order_relaxed));
+}
+
+uint64_t histogram_count(histogram_t *hist) {
+    return atomic_load_explicit(&hist->total, memory_order_relaxed);
+}
+
+uint64_t histogram_max(histogram_t *hist) {
+    return atomic_load_explicit(&hist->max, memory_order_relaxed);
+}
+
+uint64_t histogram_percentile(histogram_t *hist, double percentile) {
+    // sum the buckets instead of trusting total, they may be mid-update
+    uint64_t total = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        total += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+    }
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+    if (rank == 0) rank = 1;
+    if (rank > total) rank = total;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            uint64_t max = histogram_max(hist);
+            return value < max ? value : max;
+        }
+    }
+    return histogram_max(hist);
+}
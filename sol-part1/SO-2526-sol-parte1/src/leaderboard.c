@@ -0,0 +1,89 @@
+#include "leaderboard.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef struct {
+    leaderboard_entry_t entry;
+    int rank; // position in ranking, -1 when the slot is not ranked
+} slot_t;
+
+static slot_t *slots = NULL;
+static int *ranking = NULL; // slots ordered by score, highest first
+static int n_ranked = 0;
+static pthread_mutex_t leaderboard_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int leaderboard_init(int n_slots) {
+    slots = malloc(n_slots * sizeof(slot_t));
+    ranking = malloc(n_slots * sizeof(int));
+    if (!slots || !ranking) return -1;
+    for (int i = 0; i < n_slots; i++) slots[i].rank = -1;
+    return 0;
+}
+
+static void place(int slot, int rank) {
+    ranking[rank] = slot;
+    slots[slot].rank = rank;
+}
+
+void leaderboard_update(int slot, const char *id, int score) {
+    pthread_mutex_lock(&leaderboard_mutex);
+    slot_t *s = &slots[slot];
+    if (s->rank < 0) {
+        snprintf(s->entry.id, sizeof(s->entry.id), "%s", id);
+        place(slot, n_ranked++);
+    }
+    s->entry.score = score;
+
+    // ties keep their order, the first to reach a score stays ahead
+    int rank = s->rank;
+    while (rank > 0 && slots[ranking[rank - 1]].entry.score < score) {
+        place(ranking[rank - 1], rank);
+        rank--;
+    }
+    while (rank < n_ranked - 1 && slots[ranking[rank + 1]].entry.score > score) {
+        place(ranking[rank + 1], rank);
+        rank++;
+    }
+    place(slot, rank);
+    pthread_mutex_unlock(&leaderboard_mutex);
+}
+
+void leaderboard_remove(int slot) {
+    pthread_mutex_lock(&leaderboard_mutex);
+    int rank = slots[slot].rank;
+    if (rank >= 0) {
+        for (int i = rank; i < n_ranked - 1; i++) place(ranking[i + 1], i);
+        n_ranked--;
+        slots[slot].rank = -1;
+    }
+    pthread_mutex_unlock(&leaderboard_mutex);
+}
+
+int leaderboard_top(leaderboard_entry_t *out, int max) {
+    pthread_mutex_lock(&leaderboard_mutex);
+    int count = n_ranked < max ? n_ranked : max;
+    for (int i = 0; i < count; i++) out[i] = slots[ranking[i]].entry;
+    pthread_mutex_unlock(&leaderboard_mutex);
+    return count;
+}
+
+int leaderboard_publish(const char *filename) {
+    leaderboard_entry_t top[LEADERBOARD_TOP];
+    int count = leaderboard_top(top, LEADERBOARD_TOP);
+
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return -1;
+
+    for (int i = 0; i < count; i++) {
+        fprintf(fp, "%s %d\n", top[i].id, top[i].score);
+    }
+    if (fclose(fp) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return rename(tmp, filename);
+}
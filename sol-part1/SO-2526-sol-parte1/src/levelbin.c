@@ -0,0 +1,268 @@
+#include "levelbin.h"
+#include "parser.h"
+#include "pool.h"
+#include "script.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LEVELBIN_MAGIC "PLVB"
+
+// A source file as it was when compiled, all zero for none
+typedef struct {
+    int64_t sec, nsec, size;
+} levelbin_stamp_t;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t cell_size, pacman_size, ghost_size, command_size; // struct layout of the build that wrote it
+    int32_t width, height, tempo;
+    int32_t n_pacmans, n_ghosts;
+    uint64_t cells, pacmans, ghosts; // offsets from the start of the image
+    uint64_t scripts[1 + MAX_GHOSTS]; // of the pacman's script then each ghost's, 0 for none
+    uint64_t size;
+    char level_name[sizeof(((board_t*) 0)->level_name)];
+    char pacman_file[sizeof(((board_t*) 0)->pacman_file)];
+    char ghosts_files[MAX_GHOSTS][sizeof(((board_t*) 0)->ghosts_files[0])];
+    levelbin_stamp_t level_stamp, pacman_stamp, ghost_stamps[MAX_GHOSTS];
+} levelbin_header_t;
+
+static uint64_t align(uint64_t offset) {
+    return (offset + 63) & ~(uint64_t) 63;
+}
+
+static void release_scripts(board_t *board) {
+    if (board->pacmans) script_release(board->pacmans[0].script);
+    for (int i = 0; board->ghosts && i < board->n_ghosts; i++) script_release(board->ghosts[i].script);
+}
+
+// Entity structs in the image keep the pointer of the build that wrote them, fixed on load
+static const script_t* script_at(char *image, uint64_t offset, uint64_t size) {
+    if (offset == 0 || offset % sizeof(int) != 0 || offset + sizeof(script_t) > size) return NULL;
+    script_t *script = (script_t*) (image + offset);
+    if (script->n_ops <= 0 || script->n_ops > SCRIPT_MAX_OPS || offset + script_size(script->n_ops) > size) return NULL;
+    return script_valid(script) ? script : NULL;
+}
+
+// Sources are looked up in dirname by their base name, the directory the image
+// was compiled from may have had another name
+static void stamp_of(const char *dirname, const char *file, levelbin_stamp_t *stamp) {
+    memset(stamp, 0, sizeof(*stamp));
+    if (file[0] == '\0') return;
+    const char *name = strrchr(file, '/');
+    name = name ? name + 1 : file;
+    char path[MAX_FILENAME * 2];
+    snprintf(path, sizeof(path), "%s/%s", dirname, name);
+    struct stat st;
+    if (stat(path, &st) != 0) return;
+    stamp->sec = st.st_mtim.tv_sec;
+    stamp->nsec = st.st_mtim.tv_nsec;
+    stamp->size = st.st_size;
+}
+
+int levelbin_compile(char *filename, char *dirname, const char *output) {
+    board_t board;
+    memset(&board, 0, sizeof(board));
+    // stamped before each file is read, an edit while compiling makes the image stale
+    levelbin_stamp_t level_stamp, pacman_stamp, ghost_stamps[MAX_GHOSTS];
+    stamp_of(dirname, filename, &level_stamp);
+    int loaded = read_level(&board, filename, dirname);
+    if (loaded >= 0) {
+        stamp_of(dirname, board.pacman_file, &pacman_stamp);
+        for (int i = 0; i < board.n_ghosts; i++) stamp_of(dirname, board.ghosts_files[i], &ghost_stamps[i]);
+    }
+    if (loaded < 0 || read_pacman(&board, 0) < 0 || read_ghosts(&board) < 0) {
+        release_scripts(&board);
+        pool_free(board.board);
+        pool_free(board.pacmans);
+        pool_free(board.ghosts);
+        return -1;
+    }
+
+    levelbin_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LEVELBIN_MAGIC, 4);
+    header.version = LEVELBIN_VERSION;
+    header.cell_size = sizeof(board_pos_t);
+    header.pacman_size = sizeof(pacman_t);
+    header.ghost_size = sizeof(ghost_t);
+    header.command_size = sizeof(command_t);
+    header.width = board.width;
+    header.height = board.height;
+    header.tempo = board.tempo;
+    header.n_pacmans = board.n_pacmans;
+    header.n_ghosts = board.n_ghosts;
+    header.cells = align(sizeof(header));
+    header.pacmans = align(header.cells + (uint64_t) board.width * board.height * sizeof(board_pos_t));
+    header.ghosts = align(header.pacmans + board.n_pacmans * sizeof(pacman_t));
+    header.size = header.ghosts + board.n_ghosts * sizeof(ghost_t);
+    // every entity gets its own copy, scripts are short next to the cells
+    for (int i = 0; i <= board.n_ghosts; i++) {
+        const script_t *script = i == 0 ? board.pacmans[0].script : board.ghosts[i - 1].script;
+        if (!script) continue;
+        header.scripts[i] = align(header.size);
+        header.size = header.scripts[i] + script_size(script->n_ops);
+    }
+    memcpy(header.level_name, board.level_name, sizeof(header.level_name));
+    memcpy(header.pacman_file, board.pacman_file, sizeof(header.pacman_file));
+    memcpy(header.ghosts_files, board.ghosts_files, sizeof(header.ghosts_files));
+    header.level_stamp = level_stamp;
+    header.pacman_stamp = pacman_stamp;
+    memcpy(header.ghost_stamps, ghost_stamps, board.n_ghosts * sizeof(levelbin_stamp_t));
+
+    char *image = calloc(1, header.size);
+    memcpy(image, &header, sizeof(header));
+    memcpy(image + header.cells, board.board, board.width * board.height * sizeof(board_pos_t));
+    memcpy(image + header.pacmans, board.pacmans, board.n_pacmans * sizeof(pacman_t));
+    memcpy(image + header.ghosts, board.ghosts, board.n_ghosts * sizeof(ghost_t));
+    for (int i = 0; i <= board.n_ghosts; i++) {
+        const script_t *script = i == 0 ? board.pacmans[0].script : board.ghosts[i - 1].script;
+        if (script) memcpy(image + header.scripts[i], script, script_size(script->n_ops));
+    }
+    release_scripts(&board);
+    pool_free(board.board);
+    pool_free(board.pacmans);
+    pool_free(board.ghosts);
+
+    // a server mapping the old image keeps it, new loads see the whole new one
+    char tmp[MAX_FILENAME + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", output);
+    FILE *file = fopen(tmp, "wb");
+    int result = -1;
+    if (file) {
+        size_t written = fwrite(image, 1, header.size, file);
+        if (fclose(file) == 0 && written == header.size && rename(tmp, output) == 0) result = 0;
+        else unlink(tmp);
+    }
+    free(image);
+    return result;
+}
+
+// Whether bytes at offset lie inside an image of the given size
+static bool inside(uint64_t offset, uint64_t bytes, uint64_t size) {
+    return offset <= size && bytes <= size - offset;
+}
+
+static bool valid_image(levelbin_header_t *header, uint64_t size) {
+    if (memcmp(header->magic, LEVELBIN_MAGIC, 4) != 0 || header->version != LEVELBIN_VERSION ||
+        header->cell_size != sizeof(board_pos_t) || header->pacman_size != sizeof(pacman_t) ||
+        header->ghost_size != sizeof(ghost_t) || header->command_size != sizeof(command_t) ||
+        header->size != size ||
+        header->width <= 0 || header->height <= 0 || header->n_pacmans < 1 ||
+        header->n_ghosts < 0 || header->n_ghosts > MAX_GHOSTS) return false;
+
+    if (!inside(header->cells, (uint64_t) header->width * header->height * sizeof(board_pos_t), size) ||
+        !inside(header->pacmans, (uint64_t) header->n_pacmans * sizeof(pacman_t), size) ||
+        !inside(header->ghosts, (uint64_t) header->n_ghosts * sizeof(ghost_t), size) ||
+        header->pacmans % _Alignof(pacman_t) != 0 || header->ghosts % _Alignof(ghost_t) != 0) return false;
+
+    // names are read as strings to find the sources
+    if (!memchr(header->pacman_file, '\0', sizeof(header->pacman_file))) return false;
+    for (int i = 0; i < header->n_ghosts; i++) {
+        if (!memchr(header->ghosts_files[i], '\0', sizeof(header->ghosts_files[i]))) return false;
+    }
+
+    char *image = (char*) header;
+    pacman_t *pacmans = (pacman_t*) (image + header->pacmans);
+    ghost_t *ghosts = (ghost_t*) (image + header->ghosts);
+    for (int i = 0; i < header->n_pacmans; i++) {
+        if (pacmans[i].pos_x < 0 || pacmans[i].pos_x >= header->width ||
+            pacmans[i].pos_y < 0 || pacmans[i].pos_y >= header->height) return false;
+    }
+    for (int i = 0; i < header->n_ghosts; i++) {
+        if (ghosts[i].pos_x < 0 || ghosts[i].pos_x >= header->width ||
+            ghosts[i].pos_y < 0 || ghosts[i].pos_y >= header->height) return false;
+    }
+
+    // a ghost moves every tick, the pacman's script is optional
+    if (header->scripts[0] != 0 && !script_at(image, header->scripts[0], size)) return false;
+    for (int i = 0; i < header->n_ghosts; i++) {
+        if (!script_at(image, header->scripts[i + 1], size)) return false;
+    }
+    return true;
+}
+
+// A source changed since it was compiled, or is gone. Equal times and sizes,
+// not an older time: a copy or a checkout can give an edit an older mtime
+static bool source_changed(const char *dirname, const char *file, const levelbin_stamp_t *compiled) {
+    if (file[0] == '\0') return false;
+    levelbin_stamp_t now;
+    stamp_of(dirname, file, &now);
+    return now.sec != compiled->sec || now.nsec != compiled->nsec || now.size != compiled->size;
+}
+
+int levelbin_load(board_t *board, char *filename, char *dirname, int points) {
+    char source[MAX_FILENAME], path[MAX_FILENAME + 1];
+    snprintf(source, sizeof(source), "%s/%s", dirname, filename);
+    snprintf(path, sizeof(path), "%sb", source);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(levelbin_header_t)) {
+        close(fd);
+        return -1;
+    }
+
+    // private: moves write to this session's copy of a page, the file never changes
+    char *image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) return -1;
+
+    levelbin_header_t *header = (levelbin_header_t*) image;
+    if (!valid_image(header, st.st_size)) {
+        debug("Ignoring invalid level image %s\n", path);
+        munmap(image, st.st_size);
+        return -1;
+    }
+
+    // an edited .p or .m makes the image as stale as an edited .lvl
+    bool stale = source_changed(dirname, filename, &header->level_stamp) ||
+                 source_changed(dirname, header->pacman_file, &header->pacman_stamp);
+    for (int i = 0; i < header->n_ghosts && !stale; i++) {
+        stale = source_changed(dirname, header->ghosts_files[i], &header->ghost_stamps[i]);
+    }
+    if (stale) {
+        debug("Ignoring stale level image %s\n", path);
+        munmap(image, st.st_size);
+        return -1;
+    }
+
+    board->image = image;
+    board->image_size = st.st_size;
+    board->width = header->width;
+    board->height = header->height;
+    board->tempo = header->tempo;
+    board->n_pacmans = header->n_pacmans;
+    board->n_ghosts = header->n_ghosts;
+    board->board = (board_pos_t*) (image + header->cells);
+    board->pacmans = (pacman_t*) (image + header->pacmans);
+    board->ghosts = (ghost_t*) (image + header->ghosts);
+    // the scripts are only read, their pages stay shared with every other session
+    board->pacmans[0].script = script_at(image, header->scripts[0], header->size);
+    for (int i = 0; i < board->n_ghosts; i++) {
+        board->ghosts[i].script = script_at(image, header->scripts[i + 1], header->size);
+    }
+    memcpy(board->level_name, header->level_name, sizeof(board->level_name));
+    memcpy(board->pacman_file, header->pacman_file, sizeof(board->pacman_file));
+    memcpy(board->ghosts_files, header->ghosts_files, sizeof(board->ghosts_files));
+    board->pacmans[0].points = points;
+
+    debug("Mapped level image %s\n", path);
+    return 0;
+}
+
+void levelbin_unload(board_t *board) {
+    munmap(board->image, board->image_size);
+    board->image = NULL;
+    board->board = NULL;
+    board->pacmans = NULL;
+    board->ghosts = NULL;
+}
@@ -0,0 +1,56 @@
+#include "levelbin.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+
+// Level compiler: writes a .lvlb next to every .lvl of a directory, or only the ones named
+
+static int is_level(const struct dirent *entry) {
+    char *dot = strrchr(entry->d_name, '.');
+    return entry->d_name[0] != '.' && dot && strcmp(dot, ".lvl") == 0;
+}
+
+static int compile(char *level_dir, char *filename) {
+    char output[MAX_FILENAME + 1];
+    snprintf(output, sizeof(output), "%s/%sb", level_dir, filename);
+
+    if (levelbin_compile(filename, level_dir, output) != 0) {
+        printf("%s: failed\n", filename);
+        return -1;
+    }
+    printf("%s -> %s\n", filename, output);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s <level_directory> [level.lvl ...]\n", argv[0]);
+        return -1;
+    }
+    char *level_dir = argv[1];
+
+    // the parser logs through debug(), the listing goes to stdout
+    open_debug_file("/dev/null");
+
+    int failed = 0;
+    if (argc > 2) {
+        for (int i = 2; i < argc; i++) failed |= compile(level_dir, argv[i]);
+    } else {
+        struct dirent **levels;
+        int n_levels = scandir(level_dir, &levels, is_level, alphasort);
+        if (n_levels < 0) {
+            perror(level_dir);
+            close_debug_file();
+            return -1;
+        }
+        for (int i = 0; i < n_levels; i++) {
+            failed |= compile(level_dir, levels[i]->d_name);
+            free(levels[i]);
+        }
+        free(levels);
+    }
+
+    close_debug_file();
+    return failed ? -1 : 0;
+}
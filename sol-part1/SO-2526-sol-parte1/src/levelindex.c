@@ -0,0 +1,159 @@
+#include "levelindex.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define LEVELINDEX_SETTLE_MS 50 // quiet time after an event before rebuilding
+
+static char *directory = NULL;
+static levelindex_t *current = NULL;
+static pthread_mutex_t current_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool has_suffix(const char *name, const char *suffix) {
+    char *dot = strrchr(name, '.');
+    return dot && strcmp(dot, suffix) == 0;
+}
+
+static int is_level(const struct dirent *entry) {
+    return entry->d_name[0] != '.' && has_suffix(entry->d_name, ".lvl");
+}
+
+// A level goes in the index only if a session could play it, and then it is
+// kept as read: sessions play copies of it, not whatever is on disk by then
+static bool read_valid_level(char *filename, board_t *board) {
+    memset(board, 0, sizeof(board_t));
+    if (load_level_data(board, filename, directory, 0) != 0) return false;
+    if (board->width > 0 && board->height > 0 && board->n_pacmans > 0) return true;
+    unload_level_data(board);
+    return false;
+}
+
+static levelindex_t* build_index() {
+    struct dirent **entries;
+    int n_entries = scandir(directory, &entries, is_level, alphasort);
+    if (n_entries < 0) return NULL;
+
+    levelindex_t *index = calloc(1, sizeof(levelindex_t));
+    atomic_init(&index->refs, 1);
+    index->names = calloc(n_entries > 0 ? n_entries : 1, sizeof(*index->names));
+    index->levels = calloc(n_entries > 0 ? n_entries : 1, sizeof(board_t));
+    for (int i = 0; i < n_entries; i++) {
+        if (read_valid_level(entries[i]->d_name, &index->levels[index->n_levels])) {
+            snprintf(index->names[index->n_levels++], MAX_FILENAME, "%s", entries[i]->d_name);
+        } else {
+            log_warn("[levels] Skipping %s, it does not load\n", entries[i]->d_name);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return index;
+}
+
+static void publish(levelindex_t *index) {
+    pthread_mutex_lock(&current_mutex);
+    levelindex_t *old = current;
+    current = index;
+    pthread_mutex_unlock(&current_mutex);
+    // sessions still playing the old index free it when they end
+    if (old) levelindex_release(old);
+    log_info("[levels] %d levels indexed\n", index->n_levels);
+}
+
+static void* watch_thread(void *arg) {
+    int fd = *(int*) arg;
+    free(arg);
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    _Alignas(struct inotify_event) char buffer[4096];
+    struct pollfd pfd = {fd, POLLIN, 0};
+
+    while (true) {
+        bool changed = false;
+        int timeout = -1;
+        // an editor or levelc saving several files is one rebuild
+        while (poll(&pfd, 1, timeout) > 0) {
+            ssize_t len = read(fd, buffer, sizeof(buffer));
+            if (len <= 0) break;
+            for (char *ptr = buffer; ptr < buffer + len; ) {
+                struct inotify_event *event = (struct inotify_event*) ptr;
+                if (event->len && event->name[0] != '.' &&
+                    (has_suffix(event->name, ".lvl") || has_suffix(event->name, ".lvlb") ||
+                     has_suffix(event->name, ".m") || has_suffix(event->name, ".p"))) {
+                    changed = true;
+                }
+                ptr += sizeof(struct inotify_event) + event->len;
+            }
+            if (changed) timeout = LEVELINDEX_SETTLE_MS;
+        }
+
+        if (!changed) continue;
+        levelindex_t *index = build_index();
+        if (index) {
+            publish(index);
+            stats_add(STAT_LEVEL_INDEX_RELOADS, 1);
+        }
+    }
+    return NULL;
+}
+
+int levelindex_init(char *dirname) {
+    directory = dirname;
+    levelindex_t *index = build_index();
+    if (!index) return -1;
+    publish(index);
+
+    // without inotify the index just stays as it was at startup
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dirname, IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+        log_warn("[levels] Not watching %s for changes\n", dirname);
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+
+    int *arg = malloc(sizeof(int));
+    *arg = fd;
+    pthread_t watcher;
+    if (pthread_create(&watcher, NULL, watch_thread, arg) != 0) {
+        free(arg);
+        close(fd);
+        return 0;
+    }
+    pthread_detach(watcher);
+    return 0;
+}
+
+levelindex_t* levelindex_acquire() {
+    pthread_mutex_lock(&current_mutex);
+    levelindex_t *index = current;
+    atomic_fetch_add(&index->refs, 1);
+    pthread_mutex_unlock(&current_mutex);
+    return index;
+}
+
+void levelindex_release(levelindex_t *index) {
+    if (atomic_fetch_sub(&index->refs, 1) == 1) {
+        for (int i = 0; i < index->n_levels; i++) unload_level_data(&index->levels[i]);
+        free(index->levels);
+        free(index->names);
+        free(index);
+    }
+}
+
+int levelindex_find(levelindex_t *index, const char *level_name) {
+    size_t len = strlen(level_name);
+    for (int i = 0; i < index->n_levels; i++) {
+        if (strncmp(index->names[i], level_name, len) == 0 && strcmp(index->names[i] + len, ".lvl") == 0) return i;
+    }
+    return -1;
+}
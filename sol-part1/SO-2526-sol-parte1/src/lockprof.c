@@ -0,0 +1,215 @@
+#include "board.h"
+#include "lockprof.h"
+
+#ifdef LOCK_PROFILE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define LOCK_STRIPES 64
+#define HEATMAP_TOP 10
+
+typedef struct {
+    _Alignas(64) atomic_uint_fast64_t acquired[LOCK_CLASS_COUNT];
+    atomic_uint_fast64_t contended[LOCK_CLASS_COUNT];
+    atomic_uint_fast64_t wait_ns[LOCK_CLASS_COUNT];
+} lock_stripe_t;
+
+static lock_stripe_t stripes[LOCK_STRIPES];
+static atomic_uint next_stripe = 0;
+static _Thread_local int my_stripe = -1;
+
+static const char *class_names[LOCK_CLASS_COUNT] = {
+    [LOCK_CELL] = "cell",
+    [LOCK_CHARGE] = "charge",
+    [LOCK_STATE] = "state_lock",
+    [LOCK_SESSION] = "session_mutex",
+};
+
+// Cell contention of a level summed over every board of it unloaded so far
+typedef struct level_heat {
+    char name[sizeof(((board_t*) 0)->level_name)];
+    int width, height;
+    lock_heat_t *heat;
+    char *walls;
+    struct level_heat *next;
+} level_heat_t;
+
+static level_heat_t *levels = NULL;
+// several sessions can unload the same level at once
+static pthread_mutex_t heatmap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static lock_stripe_t* stripe() {
+    if (my_stripe < 0) {
+        my_stripe = atomic_fetch_add_explicit(&next_stripe, 1, memory_order_relaxed) % LOCK_STRIPES;
+    }
+    return &stripes[my_stripe];
+}
+
+static void record(lock_class_t lock_class, uint64_t wait, lock_heat_t *heat, int idx) {
+    lock_stripe_t *s = stripe();
+    atomic_fetch_add_explicit(&s->acquired[lock_class], 1, memory_order_relaxed);
+    if (!wait) return;
+
+    atomic_fetch_add_explicit(&s->contended[lock_class], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->wait_ns[lock_class], wait, memory_order_relaxed);
+    if (heat) {
+        __atomic_fetch_add(&heat[idx].contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&heat[idx].wait_ns, wait, __ATOMIC_RELAXED);
+    }
+}
+
+// Only contended acquisitions read the clock, the fast path is one trylock
+int lockprof_mutex_lock(pthread_mutex_t *lock, lock_class_t lock_class, lock_heat_t *heat, int idx) {
+    if (pthread_mutex_trylock(lock) == 0) {
+        record(lock_class, 0, heat, idx);
+        return 0;
+    }
+    uint64_t start = now_ns();
+    int ret = pthread_mutex_lock(lock);
+    record(lock_class, now_ns() - start + 1, heat, idx);
+    return ret;
+}
+
+int lockprof_rdlock(pthread_rwlock_t *lock) {
+    if (pthread_rwlock_tryrdlock(lock) == 0) {
+        record(LOCK_STATE, 0, NULL, 0);
+        return 0;
+    }
+    uint64_t start = now_ns();
+    int ret = pthread_rwlock_rdlock(lock);
+    record(LOCK_STATE, now_ns() - start + 1, NULL, 0);
+    return ret;
+}
+
+int lockprof_wrlock(pthread_rwlock_t *lock) {
+    if (pthread_rwlock_trywrlock(lock) == 0) {
+        record(LOCK_STATE, 0, NULL, 0);
+        return 0;
+    }
+    uint64_t start = now_ns();
+    int ret = pthread_rwlock_wrlock(lock);
+    record(LOCK_STATE, now_ns() - start + 1, NULL, 0);
+    return ret;
+}
+
+static void write_heatmap(level_heat_t *level) {
+    char filename[sizeof(level->name) + 16];
+    snprintf(filename, sizeof(filename), "lockprof_%s.txt", level->name);
+    FILE *fp = fopen(filename, "w");
+    if (!fp) return;
+
+    int cells = level->width * level->height;
+    uint64_t max_wait = 0, total_wait = 0, total_contended = 0;
+    for (int i = 0; i < cells; i++) {
+        if (level->heat[i].wait_ns > max_wait) max_wait = level->heat[i].wait_ns;
+        total_wait += level->heat[i].wait_ns;
+        total_contended += level->heat[i].contended;
+    }
+
+    fprintf(fp, "# level %s %dx%d contended %llu wait_ns %llu\n", level->name,
+            level->width, level->height, (unsigned long long) total_contended, (unsigned long long) total_wait);
+    for (int y = 0; y < level->height; y++) {
+        for (int x = 0; x < level->width; x++) {
+            int idx = y * level->width + x;
+            uint64_t wait = level->heat[idx].wait_ns;
+            if (level->walls[idx]) fputc('#', fp);
+            else if (!wait) fputc('.', fp);
+            else fputc('0' + (int) (wait * 9 / max_wait), fp);
+        }
+        fputc('\n', fp);
+    }
+
+    // hottest cells by wait then index, picked by repeated scans since HEATMAP_TOP is small
+    fprintf(fp, "# x y contended wait_ns\n");
+    int last = -1;
+    for (int n = 0; n < HEATMAP_TOP; n++) {
+        int best = -1;
+        for (int i = 0; i < cells; i++) {
+            uint64_t wait = level->heat[i].wait_ns;
+            if (!wait) continue;
+            // after the last one picked: less wait, or the same wait further on
+            if (last >= 0 && (wait > level->heat[last].wait_ns ||
+                              (wait == level->heat[last].wait_ns && i <= last))) continue;
+            if (best < 0 || wait > level->heat[best].wait_ns) best = i;
+        }
+        if (best < 0) break;
+        last = best;
+        fprintf(fp, "%d %d %llu %llu\n", best % level->width, best / level->width,
+                (unsigned long long) level->heat[best].contended, (unsigned long long) level->heat[best].wait_ns);
+    }
+    fclose(fp);
+}
+
+void lockprof_report(const char *filename) {
+    FILE *fp = fopen(filename, "w");
+    if (!fp) return;
+
+    fprintf(fp, "# class acquired contended wait_ns avg_wait_ns\n");
+    for (int c = 0; c < LOCK_CLASS_COUNT; c++) {
+        uint64_t acquired = 0, contended = 0, wait = 0;
+        for (int i = 0; i < LOCK_STRIPES; i++) {
+            acquired += atomic_load_explicit(&stripes[i].acquired[c], memory_order_relaxed);
+            contended += atomic_load_explicit(&stripes[i].contended[c], memory_order_relaxed);
+            wait += atomic_load_explicit(&stripes[i].wait_ns[c], memory_order_relaxed);
+        }
+        fprintf(fp, "%s %llu %llu %llu %llu\n", class_names[c],
+                (unsigned long long) acquired, (unsigned long long) contended,
+                (unsigned long long) wait, (unsigned long long) (contended ? wait / contended : 0));
+    }
+    fclose(fp);
+
+    pthread_mutex_lock(&heatmap_mutex);
+    for (level_heat_t *level = levels; level; level = level->next) write_heatmap(level);
+    pthread_mutex_unlock(&heatmap_mutex);
+}
+
+void lockprof_collect_heatmap(board_t *board) {
+    if (!board->lock_heat) return;
+
+    int cells = board->width * board->height;
+    uint64_t contended = 0;
+    for (int i = 0; i < cells; i++) contended += board->lock_heat[i].contended;
+    // preloaded and never played, or played without a single wait
+    if (!contended) return;
+
+    pthread_mutex_lock(&heatmap_mutex);
+    level_heat_t *level = levels;
+    while (level && strcmp(level->name, board->level_name) != 0) level = level->next;
+    // an edited level starts over once its size changes
+    if (level && (level->width != board->width || level->height != board->height)) {
+        free(level->heat);
+        free(level->walls);
+        level->heat = NULL;
+    }
+    if (!level) {
+        level = calloc(1, sizeof(level_heat_t));
+        snprintf(level->name, sizeof(level->name), "%s", board->level_name);
+        level->next = levels;
+        levels = level;
+    }
+    if (!level->heat) {
+        level->width = board->width;
+        level->height = board->height;
+        level->heat = calloc(cells, sizeof(lock_heat_t));
+        level->walls = calloc(cells, 1);
+    }
+    for (int i = 0; i < cells; i++) {
+        level->heat[i].contended += board->lock_heat[i].contended;
+        level->heat[i].wait_ns += board->lock_heat[i].wait_ns;
+        level->walls[i] = board->board[i].content == 'W';
+    }
+    pthread_mutex_unlock(&heatmap_mutex);
+}
+
+#endif
@@ -0,0 +1,209 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+
+// Each logging thread owns one single producer / single consumer ring from a fixed pool.
+// Records are a uint32_t length followed by the message bytes, head and tail only grow.
+#define LOG_RINGS 64
+#define LOG_RING_SIZE (1 << 16)
+#define LOG_WRITER_IDLE_MS 5
+
+enum {
+    RING_FREE = 0,
+    RING_OWNED,
+    RING_RELEASED, // owner exited, the writer frees it once it is drained
+};
+
+typedef struct {
+    atomic_int state;
+    _Alignas(64) atomic_uint_fast64_t head; // written by the owner
+    _Alignas(64) atomic_uint_fast64_t tail; // written by the writer thread
+    char data[LOG_RING_SIZE];
+} log_ring_t;
+
+int log_runtime_level = LOG_LEVEL;
+
+static log_ring_t rings[LOG_RINGS];
+static atomic_uint_fast64_t dropped = 0;
+
+static _Thread_local log_ring_t *my_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static FILE *debugfile = NULL;
+static pthread_t writer;
+static atomic_bool writer_running = false;
+static atomic_bool writer_stop = false;
+
+static void release_ring(void *ring) {
+    atomic_store_explicit(&((log_ring_t*) ring)->state, RING_RELEASED, memory_order_release);
+}
+
+static void create_ring_key() {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+static log_ring_t* acquire_ring() {
+    pthread_once(&ring_key_once, create_ring_key);
+    for (int i = 0; i < LOG_RINGS; i++) {
+        int expected = RING_FREE;
+        if (atomic_compare_exchange_strong(&rings[i].state, &expected, RING_OWNED)) {
+            my_ring = &rings[i];
+            // the key destructor hands the ring back when this thread exits
+            pthread_setspecific(ring_key, my_ring);
+            return my_ring;
+        }
+    }
+    return NULL;
+}
+
+static void ring_copy_in(log_ring_t *ring, uint64_t pos, const void *src, size_t len) {
+    size_t offset = pos % LOG_RING_SIZE;
+    size_t first = LOG_RING_SIZE - offset < len ? LOG_RING_SIZE - offset : len;
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const char*) src + first, len - first);
+}
+
+static void ring_copy_out(log_ring_t *ring, uint64_t pos, void *dst, size_t len) {
+    size_t offset = pos % LOG_RING_SIZE;
+    size_t first = LOG_RING_SIZE - offset < len ? LOG_RING_SIZE - offset : len;
+    memcpy(dst, ring->data + offset, first);
+    memcpy((char*) dst + first, ring->data, len - first);
+}
+
+void log_write(const char *format, ...) {
+    log_ring_t *ring = my_ring ? my_ring : acquire_ring();
+    if (!ring) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    char message[LOG_MAX_MESSAGE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (len < 0) return;
+    if (len >= LOG_MAX_MESSAGE) len = LOG_MAX_MESSAGE - 1;
+
+    uint32_t record = len;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (LOG_RING_SIZE - (head - tail) < sizeof(record) + record) {
+        // never wait for the writer, a tick is worth more than a log line
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    ring_copy_in(ring, head, &record, sizeof(record));
+    ring_copy_in(ring, head + sizeof(record), message, record);
+    atomic_store_explicit(&ring->head, head + sizeof(record) + record, memory_order_release);
+}
+
+// Writes every complete record in the ring, returns the number of records
+static int drain_ring(log_ring_t *ring, char *buffer) {
+    int records = 0;
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    while (tail != head) {
+        uint32_t record;
+        ring_copy_out(ring, tail, &record, sizeof(record));
+        ring_copy_out(ring, tail + sizeof(record), buffer, record);
+        fwrite(buffer, 1, record, debugfile);
+        tail += sizeof(record) + record;
+        records++;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    return records;
+}
+
+static int drain_all(char *buffer) {
+    int records = 0;
+    for (int i = 0; i < LOG_RINGS; i++) {
+        log_ring_t *ring = &rings[i];
+        int state = atomic_load_explicit(&ring->state, memory_order_acquire);
+        if (state == RING_FREE) continue;
+
+        records += drain_ring(ring, buffer);
+        // the owner is gone and wrote nothing after the drain, the ring can be reused
+        if (state == RING_RELEASED) {
+            atomic_store_explicit(&ring->state, RING_FREE, memory_order_release);
+        }
+    }
+    return records;
+}
+
+static void* writer_thread(void *arg) {
+    (void) arg;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    char *buffer = malloc(LOG_MAX_MESSAGE);
+    uint64_t reported_drops = 0;
+    struct timespec idle = {0, LOG_WRITER_IDLE_MS * 1000000L};
+
+    while (!atomic_load(&writer_stop)) {
+        int records = drain_all(buffer);
+
+        uint64_t drops = atomic_load_explicit(&dropped, memory_order_relaxed);
+        if (drops != reported_drops) {
+            fprintf(debugfile, "[log] %llu messages dropped\n", (unsigned long long) (drops - reported_drops));
+            reported_drops = drops;
+        }
+
+        if (records > 0) fflush(debugfile);
+        else nanosleep(&idle, NULL);
+    }
+
+    drain_all(buffer);
+    fflush(debugfile);
+    free(buffer);
+    return NULL;
+}
+
+static int parse_level(const char *value) {
+    static const char *names[] = {"error", "warn", "info", "debug"};
+    for (int i = 0; i <= LOG_DEBUG; i++) {
+        if (strcasecmp(value, names[i]) == 0) return i;
+    }
+    return atoi(value);
+}
+
+void open_debug_file(char *filename) {
+    char *level = getenv("PACMAN_LOG_LEVEL");
+    if (level) log_runtime_level = parse_level(level);
+
+    debugfile = fopen(filename, "w");
+    if (!debugfile) return;
+
+    atomic_store(&writer_stop, false);
+    if (pthread_create(&writer, NULL, writer_thread, NULL) == 0) {
+        atomic_store(&writer_running, true);
+    }
+}
+
+void close_debug_file() {
+    if (atomic_load(&writer_running)) {
+        atomic_store(&writer_stop, true);
+        pthread_join(writer, NULL);
+        atomic_store(&writer_running, false);
+    }
+    if (debugfile) fclose(debugfile);
+    debugfile = NULL;
+}
+
+uint64_t log_dropped() {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
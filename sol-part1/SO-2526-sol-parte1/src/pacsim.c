@@ -0,0 +1,132 @@
+#include "board.h"
+#include "parser.h"
+#include "script.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+// Headless simulation: plays every level of a directory with its .p/.m scripts,
+// no ncurses, no clients and no sleep_ms. One tick is one board->tempo of the server.
+
+typedef enum {
+    SIM_PORTAL,
+    SIM_DEAD,
+    SIM_QUIT,
+    SIM_TIMEOUT,
+    SIM_ERROR,
+} sim_result_t;
+
+static const char *result_names[] = {
+    [SIM_PORTAL] = "portal",
+    [SIM_DEAD] = "dead",
+    [SIM_QUIT] = "quit",
+    [SIM_TIMEOUT] = "timeout",
+    [SIM_ERROR] = "error",
+};
+
+static long max_ticks = 100000;
+static int repeats = 1;
+static unsigned int seed = 1;
+
+static command_t random_move = {'R', 1};
+
+// Same order the server threads run in: the pacman every (1 + passo) ticks, then each ghost
+static sim_result_t play_level(board_t *board, long *ticks) {
+    pacman_t *pacman = &board->pacmans[0];
+
+    for (*ticks = 0; *ticks < max_ticks; (*ticks)++) {
+        if (*ticks % (1 + pacman->passo) == 0) {
+            // a pacman without a script is played randomly
+            const command_t *play = pacman->script ? script_next(pacman->script, &pacman->pc, &pacman->loops) : &random_move;
+            if (play->command == 'Q') return SIM_QUIT;
+
+            int result = move_pacman(board, 0, play);
+            if (result == REACHED_PORTAL) return SIM_PORTAL;
+            if (result == DEAD_PACMAN) return SIM_DEAD;
+        }
+
+        for (int g = 0; g < board->n_ghosts; g++) {
+            ghost_t *ghost = &board->ghosts[g];
+            if (!ghost->script || *ticks % (1 + ghost->passo) != 0) continue;
+            move_ghost(board, g, script_next(ghost->script, &ghost->pc, &ghost->loops));
+        }
+        if (!pacman->alive) return SIM_DEAD;
+    }
+    return SIM_TIMEOUT;
+}
+
+static int is_level(const struct dirent *entry) {
+    char *dot = strrchr(entry->d_name, '.');
+    return entry->d_name[0] != '.' && dot && strcmp(dot, ".lvl") == 0;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:r:s:")) != -1) {
+        switch (opt) {
+            case 't': max_ticks = atol(optarg); break;
+            case 'r': repeats = atoi(optarg); break;
+            case 's': seed = atoi(optarg); break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (optind != argc - 1 || repeats < 1) {
+        printf("Usage: %s [-t max_ticks] [-r repeats] [-s seed] <level_directory>\n", argv[0]);
+        return -1;
+    }
+    char *level_dir = argv[optind];
+
+    // sorted so runs over the same directory are comparable
+    struct dirent **levels;
+    int n_levels = scandir(level_dir, &levels, is_level, alphasort);
+    if (n_levels < 0) {
+        perror(level_dir);
+        return -1;
+    }
+
+    // parser and board log through debug(), keep that out of the numbers
+    open_debug_file("/dev/null");
+
+    printf("%-24s %-8s %10s %8s %14s\n", "level", "result", "ticks", "points", "ticks/s");
+    long total_ticks = 0;
+    uint64_t total_ns = 0;
+
+    for (int i = 0; i < n_levels; i++) {
+        sim_result_t result = SIM_ERROR;
+        long ticks = 0, level_ticks = 0;
+        int points = 0;
+        uint64_t elapsed = 0;
+
+        for (int r = 0; r < repeats; r++) {
+            board_t board;
+            memset(&board, 0, sizeof(board));
+            // every repeat replays the same random moves
+            srand(seed);
+
+            if (load_level(&board, levels[i]->d_name, level_dir, 0) != 0) break;
+            uint64_t start = monotonic_ns();
+            result = play_level(&board, &ticks);
+            elapsed += monotonic_ns() - start;
+            points = board.pacmans[0].points;
+            level_ticks += ticks;
+            unload_level(&board);
+        }
+
+        printf("%-24s %-8s %10ld %8d %14.0f\n", levels[i]->d_name, result_names[result], ticks, points,
+               elapsed ? level_ticks * 1e9 / elapsed : 0.0);
+        total_ticks += level_ticks;
+        total_ns += elapsed;
+        free(levels[i]);
+    }
+    free(levels);
+
+    printf("%-24s %-8s %10ld %8s %14.0f\n", "total", "", total_ticks, "",
+           total_ns ? total_ticks * 1e9 / total_ns : 0.0);
+
+    close_debug_file();
+    return 0;
+}
@@ -4,6 +4,8 @@
 #include <unistd.h>
 #include "parser.h"
 #include "board.h"
+#include "pool.h"
+#include "script.h"
 #include <fcntl.h>
 
 int read_level(board_t* board, char* filename, char* dirname) {
@@ -20,6 +22,7 @@ int read_level(board_t* board, char* filename, char* dirname) {
     }
     
     char command[MAX_COMMAND_LENGTH];
+    char *save; // strtok_r state, levels are parsed by several sessions at once
 
     // Pacman is optional
     board->pacman_file[0] = '\0';
@@ -34,12 +37,12 @@ int read_level(board_t* board, char* filename, char* dirname) {
         // comment
         if (command[0] == '#' || command[0] == '\0') continue;
 
-        char *word = strtok(command, " \t\n");
+        char *word = strtok_r(command, " \t\n", &save);
         if (!word) continue;  // skip empty line
 
         if (strcmp(word, "DIM") == 0) {
-            char *arg1 = strtok(NULL, " \t\n");
-            char *arg2 = strtok(NULL, " \t\n");
+            char *arg1 = strtok_r(NULL, " \t\n", &save);
+            char *arg2 = strtok_r(NULL, " \t\n", &save);
             if (arg1 && arg2) {
                 board->width = atoi(arg1);
                 board->height = atoi(arg2);
@@ -48,7 +51,7 @@ int read_level(board_t* board, char* filename, char* dirname) {
         }
 
         else if (strcmp(word, "TEMPO") == 0) {
-            char *arg = strtok(NULL, " \t\n");
+            char *arg = strtok_r(NULL, " \t\n", &save);
             if (arg) {
                 board->tempo = atoi(arg);
                 debug("TEMPO = %d\n", board->tempo);
@@ -56,7 +59,7 @@ int read_level(board_t* board, char* filename, char* dirname) {
         }
 
         else if (strcmp(word, "PAC") == 0) {
-            char *arg = strtok(NULL, " \t\n");
+            char *arg = strtok_r(NULL, " \t\n", &save);
             if (arg) {
                 snprintf(board->pacman_file, sizeof(board->pacman_file), "%s/%s", dirname, arg);
                 debug("PAC = %s\n", board->pacman_file);
@@ -66,7 +69,7 @@ int read_level(board_t* board, char* filename, char* dirname) {
         else if (strcmp(word, "MON") == 0) {
             char *arg;
             int i = 0;
-            while ((arg = strtok(NULL, " \t\n")) != NULL) {
+            while ((arg = strtok_r(NULL, " \t\n", &save)) != NULL) {
                 snprintf(board->ghosts_files[i], sizeof(board->ghosts_files[0]), "%s/%s", dirname, arg);
                 debug("MON file: %s\n", board->ghosts_files[i]);
                 i+= 1;
@@ -87,9 +90,9 @@ int read_level(board_t* board, char* filename, char* dirname) {
     }
     
     // the end of the file contains the grid
-    board->board = calloc(board->width * board->height, sizeof(board_pos_t));
-    board->pacmans = calloc(board->n_pacmans, sizeof(pacman_t));
-    board->ghosts = calloc(board->n_ghosts, sizeof(ghost_t));
+    board->board = pool_calloc(board->width * board->height, sizeof(board_pos_t));
+    board->pacmans = pool_calloc(board->n_pacmans, sizeof(pacman_t));
+    board->ghosts = pool_calloc(board->n_ghosts, sizeof(ghost_t));
 
     int row = 0;
     // command here still holds the previous line
@@ -141,7 +144,7 @@ int read_pacman(board_t* board, int points) {
     if (board->pacman_file[0] == '\0') {
         pacman->passo = 0;
         pacman->waiting = 0;
-        pacman->n_moves = 0; // user controlled
+        pacman->script = NULL; // user controlled
         // default position -> find first non occupied cell
         for (int i = 0; i < board->height; i++) {
             for (int j = 0; j < board->width; j++) {
@@ -163,15 +166,16 @@ int read_pacman(board_t* board, int points) {
 
     int read;
     char command[MAX_COMMAND_LENGTH];
+    char *save;
     while ((read = read_line(fd, command)) > 0) {
         // comment
         if (command[0] == '#' || command[0] == '\0') continue;
 
-        char *word = strtok(command, " \t\n");
+        char *word = strtok_r(command, " \t\n", &save);
         if (!word) continue;  // skip empty line
 
         if (strcmp(word, "PASSO") == 0) {
-            char *arg = strtok(NULL, " \t\n");
+            char *arg = strtok_r(NULL, " \t\n", &save);
             if (arg) {
                 pacman->passo = atoi(arg);
                 pacman->waiting = pacman->passo;
@@ -179,8 +183,8 @@ int read_pacman(board_t* board, int points) {
             }
         }
         else if (strcmp(word, "POS") == 0) {
-            char *arg1 = strtok(NULL, " \t\n");
-            char *arg2 = strtok(NULL, " \t\n");
+            char *arg1 = strtok_r(NULL, " \t\n", &save);
+            char *arg2 = strtok_r(NULL, " \t\n", &save);
             if (arg1 && arg2) {
                 pacman->pos_x = atoi(arg1);
                 pacman->pos_y = atoi(arg2);
@@ -194,37 +198,11 @@ int read_pacman(board_t* board, int points) {
         }
     }
 
-    // end of the file contains the moves
-    pacman->current_move = 0;
-    
-    // command here still holds the previous line
-    int move = 0;
-    while (read > 0 && move < MAX_MOVES) {
-        if (command[0]== '#' || command[0] == '\0') continue;
-        if (command[0] == 'A' ||
-            command[0] == 'D' ||
-            command[0] == 'W' ||
-            command[0] == 'S' ||
-            command[0] == 'R' ||
-            command[0] == 'G' ||  // FIXME: so para testar
-            command[0] == 'Q') {  // FIXME: so para testar
-                pacman->moves[move].command = command[0];
-                pacman->moves[move].turns = 1;
-                move += 1;
-        }
-        else if (command[0] == 'T' && command[1] == ' ') { 
-            int t = atoi(command+2);
-            if (t > 0) {
-                pacman->moves[move].command = command[0];
-                pacman->moves[move].turns = t;
-                pacman->moves[move].turns_left = t;
-                move += 1;
-            }
-        }
-
-        read = read_line(fd, command);
-    }
-    pacman->n_moves = move;
+    // end of the file contains the moves, compiled once for every board using the file
+    pacman->script = script_acquire(board->pacman_file, SCRIPT_PACMAN);
+    pacman->pc = 0;
+    pacman->loops.depth = 0;
+    pacman->turns_left = 0;
 
     if (read == -1) {
         debug("Failed reading line\n");
@@ -244,15 +222,16 @@ int read_ghosts(board_t* board) {
 
         int read;
         char command[MAX_COMMAND_LENGTH];
+        char *save;
         while ((read = read_line(fd, command)) > 0) {
             // comment
             if (command[0] == '#' || command[0] == '\0') continue;
 
-            char *word = strtok(command, " \t\n");
+            char *word = strtok_r(command, " \t\n", &save);
             if (!word) continue;  // skip empty line
 
             if (strcmp(word, "PASSO") == 0) {
-                char *arg = strtok(NULL, " \t\n");
+                char *arg = strtok_r(NULL, " \t\n", &save);
                 if (arg) {
                     ghost->passo = atoi(arg);
                     ghost->waiting = ghost->passo;
@@ -260,8 +239,8 @@ int read_ghosts(board_t* board) {
                 }
             }
             else if (strcmp(word, "POS") == 0) {
-                char *arg1 = strtok(NULL, " \t\n");
-                char *arg2 = strtok(NULL, " \t\n");
+                char *arg1 = strtok_r(NULL, " \t\n", &save);
+                char *arg2 = strtok_r(NULL, " \t\n", &save);
                 if (arg1 && arg2) {
                     ghost->pos_x = atoi(arg1);
                     ghost->pos_y = atoi(arg2);
@@ -276,34 +255,10 @@ int read_ghosts(board_t* board) {
         }
 
         // end of the file contains the moves
-        ghost->current_move = 0;
-
-        // command here still holds the previous line
-        int move = 0;
-        while (read > 0 && move < MAX_MOVES) {
-            if (command[0]== '#' || command[0] == '\0') continue;
-            if (command[0] == 'A' ||
-                command[0] == 'D' ||
-                command[0] == 'W' ||
-                command[0] == 'S' ||
-                command[0] == 'R' ||
-                command[0] == 'C') {
-                    ghost->moves[move].command = command[0];
-                    ghost->moves[move].turns = 1; 
-                    move += 1;
-            }
-            else if (command[0] == 'T' && command[1] == ' ') {
-                int t = atoi(command+2);
-                if (t > 0) {
-                    ghost->moves[move].command = command[0];
-                    ghost->moves[move].turns = t;
-                    ghost->moves[move].turns_left = t;
-                    move += 1;
-                }
-            }
-            read = read_line(fd, command);
-        }
-        ghost->n_moves = move;
+        ghost->script = script_acquire(board->ghosts_files[i], SCRIPT_GHOST);
+        ghost->pc = 0;
+        ghost->loops.depth = 0;
+        ghost->turns_left = 0;
 
         if (read == -1) {
             debug("Failed reading line\n");
@@ -0,0 +1,95 @@
+#include "pool.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define POOL_MIN_SHIFT 6 // smallest class holds 64 bytes
+#define POOL_CLASSES 22 // largest holds 128MB, bigger blocks go to the system allocator
+
+// Sits in front of every block, 16 bytes so the block keeps malloc's alignment
+typedef struct {
+    pool_t *pool; // NULL if the block came from calloc
+    size_t class;
+} block_header_t;
+
+typedef struct free_block {
+    struct free_block *next;
+} free_block_t;
+
+struct pool {
+    pthread_mutex_t mutex; // the session thread and its preload thread share the pool
+    free_block_t *free[POOL_CLASSES];
+};
+
+static _Thread_local pool_t *my_pool = NULL;
+
+pool_t* pool_create() {
+    pool_t *pool = calloc(1, sizeof(pool_t));
+    pthread_mutex_init(&pool->mutex, NULL);
+    return pool;
+}
+
+void pool_use(pool_t *pool) {
+    my_pool = pool;
+}
+
+pool_t* pool_current() {
+    return my_pool;
+}
+
+static size_t size_class(size_t bytes) {
+    size_t class = 0;
+    while (class < POOL_CLASSES && ((size_t) 1 << (POOL_MIN_SHIFT + class)) < bytes) class++;
+    return class;
+}
+
+void* pool_calloc(size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) return NULL;
+    size_t bytes = count * size;
+    pool_t *pool = my_pool;
+    size_t class = size_class(bytes);
+
+    block_header_t *header;
+    if (!pool || class == POOL_CLASSES) {
+        header = calloc(1, sizeof(block_header_t) + bytes);
+        if (!header) return NULL;
+        header->pool = NULL;
+        return header + 1;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    free_block_t *block = pool->free[class];
+    if (block) pool->free[class] = block->next;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (block) {
+        header = (block_header_t*) block - 1;
+    } else {
+        size_t capacity = (size_t) 1 << (POOL_MIN_SHIFT + class);
+        header = malloc(sizeof(block_header_t) + capacity);
+        if (!header) return NULL;
+        header->pool = pool;
+        header->class = class;
+    }
+
+    // only what the caller asked for is cleared, not the whole class
+    memset(header + 1, 0, bytes);
+    return header + 1;
+}
+
+void pool_free(void *ptr) {
+    if (!ptr) return;
+    block_header_t *header = (block_header_t*) ptr - 1;
+    pool_t *pool = header->pool;
+    if (!pool) {
+        free(header);
+        return;
+    }
+
+    free_block_t *block = (free_block_t*) ptr;
+    pthread_mutex_lock(&pool->mutex);
+    block->next = pool->free[header->class];
+    pool->free[header->class] = block;
+    pthread_mutex_unlock(&pool->mutex);
+}
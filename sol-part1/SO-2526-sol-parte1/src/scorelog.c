@@ -0,0 +1,386 @@
+#include "scorelog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#define SKIP_MAX_HEIGHT 16
+#define SNAPSHOT_MAGIC "PSNP"
+#define SCORELOG_PATH_LENGTH 256
+
+typedef struct {
+    score_record_t record;
+    bool keep; // marked by compaction
+} entry_t;
+
+typedef struct skip_node {
+    entry_t *entry;
+    struct skip_node *next[]; // one pointer per level of the node
+} skip_node_t;
+
+// Ordered by score, then by seq so older records win ties
+typedef struct {
+    skip_node_t *head;
+    int height;
+} skip_list_t;
+
+typedef struct {
+    char name[SCORELOG_LEVEL_LENGTH];
+    skip_list_t list;
+} level_index_t;
+
+typedef struct {
+    char magic[4];
+    uint32_t count;
+    uint64_t last_seq; // every record up to this seq is folded in the snapshot
+} snapshot_header_t;
+
+static char log_path[SCORELOG_PATH_LENGTH];
+static char old_log_path[SCORELOG_PATH_LENGTH];
+static char snap_path[SCORELOG_PATH_LENGTH];
+static char snap_tmp_path[SCORELOG_PATH_LENGTH];
+
+static int log_fd = -1;
+static uint64_t next_seq = 1;
+static int appended = 0; // since the last compaction
+static unsigned int height_seed = 1;
+
+static skip_list_t all_time;
+static level_index_t *levels = NULL;
+static int n_levels = 0;
+
+static bool stopping = false;
+static bool compactor_running = false;
+static pthread_t compactor;
+static pthread_mutex_t scorelog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+
+static uint32_t checksum(const score_record_t *record) {
+    const unsigned char *bytes = (const unsigned char*) record;
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < offsetof(score_record_t, checksum); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static skip_node_t* new_node(entry_t *entry, int height) {
+    skip_node_t *node = calloc(1, sizeof(skip_node_t) + height * sizeof(skip_node_t*));
+    node->entry = entry;
+    return node;
+}
+
+static void skip_init(skip_list_t *list) {
+    list->head = new_node(NULL, SKIP_MAX_HEIGHT);
+    list->height = 1;
+}
+
+static void skip_free(skip_list_t *list) {
+    skip_node_t *node = list->head;
+    while (node) {
+        skip_node_t *next = node->next[0];
+        free(node);
+        node = next;
+    }
+    list->head = NULL;
+}
+
+static bool ranks_before(const score_record_t *a, const score_record_t *b) {
+    return a->score > b->score || (a->score == b->score && a->seq < b->seq);
+}
+
+static void skip_insert(skip_list_t *list, entry_t *entry) {
+    int height = 1;
+    while (height < SKIP_MAX_HEIGHT && (rand_r(&height_seed) & 3) == 0) height++;
+
+    skip_node_t *update[SKIP_MAX_HEIGHT];
+    skip_node_t *node = list->head;
+    for (int h = list->height - 1; h >= 0; h--) {
+        while (node->next[h] && ranks_before(&node->next[h]->entry->record, &entry->record)) {
+            node = node->next[h];
+        }
+        update[h] = node;
+    }
+    for (int h = list->height; h < height; h++) update[h] = list->head;
+    if (height > list->height) list->height = height;
+
+    skip_node_t *inserted = new_node(entry, height);
+    for (int h = 0; h < height; h++) {
+        inserted->next[h] = update[h]->next[h];
+        update[h]->next[h] = inserted;
+    }
+}
+
+static skip_list_t* level_list(const char *level, bool create) {
+    for (int i = 0; i < n_levels; i++) {
+        if (strcmp(levels[i].name, level) == 0) return &levels[i].list;
+    }
+    if (!create) return NULL;
+
+    levels = realloc(levels, (n_levels + 1) * sizeof(level_index_t));
+    level_index_t *index = &levels[n_levels++];
+    snprintf(index->name, sizeof(index->name), "%s", level);
+    skip_init(&index->list);
+    return &index->list;
+}
+
+// Called with scorelog_mutex held
+static void index_record(const score_record_t *record) {
+    entry_t *entry = malloc(sizeof(entry_t));
+    entry->record = *record;
+    entry->keep = false;
+    skip_insert(&all_time, entry);
+    skip_insert(level_list(record->level, true), entry);
+    if (record->seq >= next_seq) next_seq = record->seq + 1;
+}
+
+// A snapshot that doesn't hold exactly the records its header counts is left out,
+// the whole log is replayed instead (last_seq stays 0)
+static int load_snapshot(uint64_t *last_seq) {
+    *last_seq = 0;
+    int fd = open(snap_path, O_RDONLY);
+    if (fd == -1) return 0;
+
+    snapshot_header_t header;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, 4) != 0 ||
+        (uint64_t) st.st_size != sizeof(header) + (uint64_t) header.count * sizeof(score_record_t)) {
+        fprintf(stderr, "scorelog: ignoring %s, it is not a whole snapshot\n", snap_path);
+        close(fd);
+        return 0;
+    }
+
+    score_record_t *records = malloc(header.count * sizeof(score_record_t));
+    ssize_t size = header.count * sizeof(score_record_t);
+    if (read(fd, records, size) != size) {
+        free(records);
+        close(fd);
+        return -1;
+    }
+    for (uint32_t i = 0; i < header.count; i++) {
+        if (records[i].checksum == checksum(&records[i])) index_record(&records[i]);
+    }
+    *last_seq = header.last_seq;
+    if (header.last_seq >= next_seq) next_seq = header.last_seq + 1;
+
+    free(records);
+    close(fd);
+    return 0;
+}
+
+// Indexes the records of a log written after the snapshot, stops at a torn tail
+static void replay_log(const char *path, uint64_t after_seq) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return;
+
+    score_record_t record;
+    while (read(fd, &record, sizeof(record)) == sizeof(record)) {
+        if (record.checksum != checksum(&record) || record.seq <= after_seq) continue;
+        index_record(&record);
+        appended++;
+    }
+    close(fd);
+}
+
+// Keeps the entries in the first SCORELOG_KEEP of any list, returns them in all-time order.
+// Called with scorelog_mutex held.
+static score_record_t* prune(uint32_t *count) {
+    int kept = 0;
+    skip_node_t *node = all_time.head->next[0];
+    for (int i = 0; node && i < SCORELOG_KEEP; i++, node = node->next[0]) node->entry->keep = true;
+    for (int l = 0; l < n_levels; l++) {
+        node = levels[l].list.head->next[0];
+        for (int i = 0; node && i < SCORELOG_KEEP; i++, node = node->next[0]) node->entry->keep = true;
+    }
+
+    int total = 0;
+    for (node = all_time.head->next[0]; node; node = node->next[0]) total++;
+    score_record_t *records = malloc((total ? total : 1) * sizeof(score_record_t));
+    entry_t **entries = malloc((total ? total : 1) * sizeof(entry_t*));
+    for (node = all_time.head->next[0]; node; node = node->next[0]) {
+        if (node->entry->keep) entries[kept++] = node->entry;
+        else free(node->entry);
+    }
+
+    // rebuild the lists with the survivors
+    skip_free(&all_time);
+    skip_init(&all_time);
+    for (int l = 0; l < n_levels; l++) {
+        skip_free(&levels[l].list);
+        skip_init(&levels[l].list);
+    }
+    for (int i = 0; i < kept; i++) {
+        entries[i]->keep = false;
+        records[i] = entries[i]->record;
+        skip_insert(&all_time, entries[i]);
+        skip_insert(level_list(entries[i]->record.level, true), entries[i]);
+    }
+    free(entries);
+
+    *count = kept;
+    return records;
+}
+
+static void compact() {
+    pthread_mutex_lock(&scorelog_mutex);
+    // new appends go to a fresh log while the old one is folded in the snapshot
+    if (log_fd != -1) close(log_fd);
+    rename(log_path, old_log_path);
+    log_fd = open(log_path, O_CREAT | O_WRONLY | O_APPEND, S_IRUSR | S_IWUSR);
+
+    snapshot_header_t header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+    header.last_seq = next_seq - 1;
+    score_record_t *records = prune(&header.count);
+    appended = 0;
+    pthread_mutex_unlock(&scorelog_mutex);
+
+    int fd = open(snap_tmp_path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    if (fd != -1) {
+        ssize_t size = header.count * sizeof(score_record_t);
+        bool ok = write(fd, &header, sizeof(header)) == sizeof(header) && write(fd, records, size) == size;
+        ok = fsync(fd) == 0 && ok;
+        close(fd);
+        // the old log can only go once the snapshot holding its records is in place
+        if (ok && rename(snap_tmp_path, snap_path) == 0) unlink(old_log_path);
+    }
+    free(records);
+}
+
+static void* compaction_thread(void *arg) {
+    (void) arg;
+
+    // SIGUSR1 belongs to the connection thread
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    while (true) {
+        pthread_mutex_lock(&scorelog_mutex);
+        while (!stopping && appended < SCORELOG_COMPACT_EVERY) {
+            pthread_cond_wait(&compact_cond, &scorelog_mutex);
+        }
+        bool stop = stopping;
+        pthread_mutex_unlock(&scorelog_mutex);
+        if (stop) break;
+        compact();
+    }
+    return NULL;
+}
+
+int scorelog_open(const char *prefix) {
+    snprintf(log_path, sizeof(log_path), "%s.log", prefix);
+    snprintf(old_log_path, sizeof(old_log_path), "%s.log.old", prefix);
+    snprintf(snap_path, sizeof(snap_path), "%s.snap", prefix);
+    snprintf(snap_tmp_path, sizeof(snap_tmp_path), "%s.snap.tmp", prefix);
+
+    skip_init(&all_time);
+
+    uint64_t last_seq;
+    if (load_snapshot(&last_seq) != 0) return -1;
+    // a compaction that did not finish leaves its old log behind
+    bool interrupted = access(old_log_path, F_OK) == 0;
+    replay_log(old_log_path, last_seq);
+    replay_log(log_path, last_seq);
+    if (interrupted || appended >= SCORELOG_COMPACT_EVERY) compact();
+
+    if (log_fd == -1) log_fd = open(log_path, O_CREAT | O_WRONLY | O_APPEND, S_IRUSR | S_IWUSR);
+    if (log_fd == -1) return -1;
+
+    if (pthread_create(&compactor, NULL, compaction_thread, NULL) != 0) return -1;
+    compactor_running = true;
+    return 0;
+}
+
+void scorelog_append(const char *id, const char *level, int score, int levels_cleared, uint64_t duration_ms) {
+    score_record_t record;
+    memset(&record, 0, sizeof(record)); // padding is part of the checksum
+    snprintf(record.id, sizeof(record.id), "%s", id);
+    snprintf(record.level, sizeof(record.level), "%s", level);
+    record.score = score;
+    record.levels_cleared = levels_cleared;
+    record.duration_ms = duration_ms;
+
+    pthread_mutex_lock(&scorelog_mutex);
+    record.seq = next_seq;
+    record.checksum = checksum(&record);
+    // one write per record, O_APPEND keeps them whole
+    if (log_fd != -1 && write(log_fd, &record, sizeof(record)) != sizeof(record)) {
+        perror("scorelog");
+    }
+    index_record(&record);
+    if (++appended >= SCORELOG_COMPACT_EVERY) pthread_cond_signal(&compact_cond);
+    pthread_mutex_unlock(&scorelog_mutex);
+}
+
+int scorelog_top(const char *level, score_record_t *out, int n) {
+    int count = 0;
+    pthread_mutex_lock(&scorelog_mutex);
+    skip_list_t *list = level ? level_list(level, false) : &all_time;
+    if (list) {
+        for (skip_node_t *node = list->head->next[0]; node && count < n; node = node->next[0]) {
+            out[count++] = node->entry->record;
+        }
+    }
+    pthread_mutex_unlock(&scorelog_mutex);
+    return count;
+}
+
+static void write_top(FILE *fp, const char *level) {
+    score_record_t top[5];
+    int count = scorelog_top(level, top, 5);
+    for (int i = 0; i < count; i++) {
+        fprintf(fp, "%s %d %d %llu\n", top[i].id, top[i].score, top[i].levels_cleared,
+                (unsigned long long) top[i].duration_ms);
+    }
+}
+
+int scorelog_publish(const char *filename) {
+    char tmp[SCORELOG_PATH_LENGTH];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return -1;
+
+    fprintf(fp, "# all-time: id score levels_cleared duration_ms\n");
+    write_top(fp, NULL);
+
+    pthread_mutex_lock(&scorelog_mutex);
+    int n = n_levels;
+    char (*names)[SCORELOG_LEVEL_LENGTH] = malloc((n ? n : 1) * SCORELOG_LEVEL_LENGTH);
+    for (int i = 0; i < n; i++) memcpy(names[i], levels[i].name, SCORELOG_LEVEL_LENGTH);
+    pthread_mutex_unlock(&scorelog_mutex);
+
+    for (int i = 0; i < n; i++) {
+        fprintf(fp, "# level %s\n", names[i]);
+        write_top(fp, names[i]);
+    }
+    free(names);
+
+    if (fclose(fp) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return rename(tmp, filename);
+}
+
+void scorelog_close() {
+    if (compactor_running) {
+        pthread_mutex_lock(&scorelog_mutex);
+        stopping = true;
+        pthread_cond_signal(&compact_cond);
+        pthread_mutex_unlock(&scorelog_mutex);
+        pthread_join(compactor, NULL);
+        compactor_running = false;
+        compact();
+    }
+    if (log_fd != -1) close(log_fd);
+    log_fd = -1;
+}
@@ -0,0 +1,221 @@
+#include "script.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+typedef struct cache_entry {
+    char path[MAX_FILENAME];
+    script_kind_t kind;
+    struct timespec mtime;
+    off_t size;
+    int refs;
+    bool stale; // the file changed, freed with its last reference
+    script_t *script;
+    struct cache_entry *next;
+} cache_entry_t;
+
+static cache_entry_t *cache = NULL;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    command_t *ops;
+    int n_ops;
+    int capacity;
+} builder_t;
+
+static bool emit(builder_t *builder, char command, int turns) {
+    if (builder->n_ops == SCRIPT_MAX_OPS) return false;
+    if (builder->n_ops == builder->capacity) {
+        builder->capacity = builder->capacity ? builder->capacity * 2 : 16;
+        builder->ops = realloc(builder->ops, builder->capacity * sizeof(command_t));
+    }
+    builder->ops[builder->n_ops++] = (command_t) {command, turns};
+    return true;
+}
+
+// Closes the block opened at start. One without moves is left out, so every
+// loop plays something and script_next never spins
+static bool close_block(builder_t *builder, int start) {
+    if (builder->n_ops == start + 1) {
+        builder->n_ops--;
+        return true;
+    }
+    return emit(builder, ']', start);
+}
+
+static bool is_command(char c, script_kind_t kind) {
+    if (strchr("WASDR", c)) return true;
+    if (kind == SCRIPT_PACMAN) return c == 'G' || c == 'Q';
+    return c == 'C' || c == 'H';
+}
+
+static script_t* compile(const char *path, script_kind_t kind) {
+    FILE *file = fopen(path, "r");
+    if (!file) return NULL;
+
+    builder_t builder = {NULL, 0, 0};
+    int blocks[SCRIPT_MAX_DEPTH]; // index of the '[' of each open REPEAT
+    int depth = 0;
+    bool ok = true;
+
+    char *line = NULL;
+    size_t line_size = 0;
+    while (ok && getline(&line, &line_size, file) != -1) {
+        char *save;
+        char *word = strtok_r(line, " \t\r\n", &save);
+        // comments, blank lines and the PASSO/POS header the parser reads
+        if (!word || word[0] == '#') continue;
+        char *arg = strtok_r(NULL, " \t\r\n", &save);
+
+        if (word[1] == '\0' && is_command(word[0], kind)) {
+            ok = emit(&builder, word[0], 1);
+        } else if (strcmp(word, "T") == 0 && arg && atoi(arg) > 0) {
+            ok = emit(&builder, 'T', atoi(arg));
+        } else if (strcmp(word, "REPEAT") == 0 && arg && atoi(arg) > 0 && depth < SCRIPT_MAX_DEPTH) {
+            blocks[depth++] = builder.n_ops;
+            ok = emit(&builder, '[', atoi(arg));
+        } else if (strcmp(word, "END") == 0 && depth > 0) {
+            ok = close_block(&builder, blocks[--depth]);
+        }
+    }
+    // a REPEAT left open runs to the end of the file
+    while (ok && depth > 0) ok = close_block(&builder, blocks[--depth]);
+    free(line);
+    fclose(file);
+
+    if (!ok) log_warn("[script] %s has more than %d ops\n", path, SCRIPT_MAX_OPS);
+    script_t *script = NULL;
+    if (ok && builder.n_ops > 0) {
+        script = malloc(script_size(builder.n_ops));
+        script->n_ops = builder.n_ops;
+        memcpy(script->ops, builder.ops, builder.n_ops * sizeof(command_t));
+    }
+    free(builder.ops);
+    return script;
+}
+
+static void drop(cache_entry_t *entry) {
+    for (cache_entry_t **e = &cache; *e; e = &(*e)->next) {
+        if (*e == entry) {
+            *e = entry->next;
+            break;
+        }
+    }
+    free(entry->script);
+    free(entry);
+}
+
+const script_t* script_acquire(const char *path, script_kind_t kind) {
+    struct stat st;
+    if (stat(path, &st) != 0) return NULL;
+
+    pthread_mutex_lock(&cache_mutex);
+    for (cache_entry_t *entry = cache; entry; entry = entry->next) {
+        if (entry->stale || entry->kind != kind || strcmp(entry->path, path) != 0) continue;
+        if (entry->size == st.st_size && entry->mtime.tv_sec == st.st_mtim.tv_sec &&
+            entry->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            if (entry->script) entry->refs++;
+            pthread_mutex_unlock(&cache_mutex);
+            return entry->script;
+        }
+        entry->stale = true;
+        if (entry->refs == 0) drop(entry);
+        break;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    // compiled without the lock, another session may get here first with the same file.
+    // A file without moves is cached too, as a NULL script
+    script_t *script = compile(path, kind);
+
+    cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+    snprintf(entry->path, sizeof(entry->path), "%s", path);
+    entry->kind = kind;
+    entry->mtime = st.st_mtim;
+    entry->size = st.st_size;
+    entry->refs = script ? 1 : 0;
+    entry->script = script;
+
+    pthread_mutex_lock(&cache_mutex);
+    for (cache_entry_t *e = cache, *next; e; e = next) {
+        next = e->next;
+        if (e->stale || e->kind != kind || strcmp(e->path, path) != 0) continue;
+        e->stale = true;
+        if (e->refs == 0) drop(e);
+    }
+    entry->next = cache;
+    cache = entry;
+    pthread_mutex_unlock(&cache_mutex);
+    return script;
+}
+
+void script_release(const script_t *script) {
+    if (!script) return;
+    pthread_mutex_lock(&cache_mutex);
+    for (cache_entry_t *entry = cache; entry; entry = entry->next) {
+        if (entry->script != script) continue;
+        // kept while the file is unchanged, the next level load finds it compiled
+        if (--entry->refs == 0 && entry->stale) drop(entry);
+        break;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void script_retain(const script_t *script) {
+    if (!script) return;
+    pthread_mutex_lock(&cache_mutex);
+    for (cache_entry_t *entry = cache; entry; entry = entry->next) {
+        if (entry->script != script) continue;
+        entry->refs++;
+        break;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+size_t script_size(int n_ops) {
+    return sizeof(script_t) + n_ops * sizeof(command_t);
+}
+
+bool script_valid(const script_t *script) {
+    int blocks[SCRIPT_MAX_DEPTH];
+    int depth = 0;
+    for (int i = 0; i < script->n_ops; i++) {
+        const command_t *op = &script->ops[i];
+        if (op->command == '[') {
+            if (depth == SCRIPT_MAX_DEPTH || op->turns <= 0) return false;
+            blocks[depth++] = i;
+        } else if (op->command == ']') {
+            // matches the innermost open block, which has a move in it
+            if (depth == 0 || op->turns != blocks[depth - 1] || i == op->turns + 1) return false;
+            depth--;
+        }
+    }
+    return depth == 0;
+}
+
+const command_t* script_next(const script_t *script, int *pc, script_loops_t *loops) {
+    // every block has a move, so this ends within two passes over the script
+    while (true) {
+        if (*pc >= script->n_ops) {
+            *pc = 0;
+            loops->depth = 0;
+        }
+        const command_t *op = &script->ops[*pc];
+        if (op->command == '[') {
+            loops->left[loops->depth++] = op->turns;
+            (*pc)++;
+        } else if (op->command == ']') {
+            if (--loops->left[loops->depth - 1] > 0) {
+                *pc = op->turns + 1;
+            } else {
+                loops->depth--;
+                (*pc)++;
+            }
+        } else {
+            return op;
+        }
+    }
+}
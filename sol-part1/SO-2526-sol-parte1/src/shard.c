@@ -0,0 +1,107 @@
+#include "shard.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef struct {
+    shard_pool_t *pool;
+    int shard;
+    pthread_t tid;
+} shard_worker_t;
+
+struct shard_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned round;
+    int running; // shards of the round not finished yet
+    bool stopping;
+    shard_fn_t fn;
+    void *arg;
+    int n_shards;
+    shard_worker_t workers[MAX_SHARDS];
+};
+
+static void* shard_thread(void *arg) {
+    shard_worker_t *worker = (shard_worker_t*) arg;
+    shard_pool_t *pool = worker->pool;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        while (seen == pool->round && !pool->stopping) pthread_cond_wait(&pool->start, &pool->mutex);
+        if (pool->stopping) break;
+        seen = pool->round;
+        pthread_mutex_unlock(&pool->mutex);
+
+        pool->fn(pool->arg, worker->shard, pool->n_shards);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->running == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+shard_pool_t* shard_pool_create(int n_shards) {
+    if (n_shards < 2) return NULL;
+    if (n_shards > MAX_SHARDS) n_shards = MAX_SHARDS;
+    shard_pool_t *pool = calloc(1, sizeof(shard_pool_t));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    // the caller plays shard 0, a thread that can't be created just means fewer shards
+    pool->n_shards = 1;
+    for (int i = 1; i < n_shards; i++) {
+        shard_worker_t *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->shard = i;
+        if (pthread_create(&worker->tid, NULL, shard_thread, worker) != 0) break;
+        pool->n_shards++;
+    }
+    if (pool->n_shards == 1) {
+        shard_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void shard_pool_destroy(shard_pool_t *pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 1; i < pool->n_shards; i++) pthread_join(pool->workers[i].tid, NULL);
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+}
+
+int shard_pool_size(shard_pool_t *pool) {
+    return pool ? pool->n_shards : 1;
+}
+
+void shard_run(shard_pool_t *pool, shard_fn_t fn, void *arg) {
+    if (!pool) {
+        fn(arg, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->running = pool->n_shards - 1;
+    pool->round++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+
+    fn(arg, 0, pool->n_shards);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->running > 0) pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
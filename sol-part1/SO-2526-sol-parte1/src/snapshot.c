@@ -0,0 +1,230 @@
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC "PSES"
+
+typedef struct {
+    char magic[4];
+    uint32_t slot_size;
+} file_header_t;
+
+// Followed by the cells, the pacmans and the ghosts of the level
+typedef struct {
+    _Atomic uint64_t seq; // 0 while the slot is being written
+    uint32_t checksum; // of every byte of the slot after it
+    int32_t levels_cleared;
+    int32_t width, height;
+    int32_t n_pacmans, n_ghosts;
+    char level[sizeof(((board_t*) 0)->level_name)];
+} slot_header_t;
+
+static int every = 0;
+static const char *directory = "snapshots";
+
+static size_t slot_size(int width, int height, int n_pacmans, int n_ghosts) {
+    size_t size = sizeof(slot_header_t) + (size_t) width * height * sizeof(board_pos_t) +
+                  n_pacmans * sizeof(pacman_t) + n_ghosts * sizeof(ghost_t);
+    return (size + 63) & ~(size_t) 63;
+}
+
+static uint32_t checksum(const char *slot, size_t size) {
+    const unsigned char *bytes = (const unsigned char*) slot;
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (size_t i = offsetof(slot_header_t, levels_cleared); i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static char* slot_at(snapshot_t *snapshot, uint64_t seq) {
+    size_t size = ((file_header_t*) snapshot->map)->slot_size;
+    return snapshot->map + sizeof(file_header_t) + (seq & 1) * size;
+}
+
+int snapshot_init() {
+    char *value = getenv("PACMAN_SNAPSHOT_EVERY");
+    every = value ? atoi(value) : 0;
+    if (every <= 0) {
+        every = 0;
+        return 0;
+    }
+
+    char *dir = getenv("PACMAN_SNAPSHOT_DIR");
+    if (dir) directory = dir;
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+int snapshot_every() {
+    return every;
+}
+
+snapshot_t* snapshot_open(const char *id) {
+    if (!every) return NULL;
+    snapshot_t *snapshot = calloc(1, sizeof(snapshot_t));
+    snprintf(snapshot->path, sizeof(snapshot->path), "%s/%s.snap", directory, id);
+    return snapshot;
+}
+
+int snapshot_pending(snapshot_t *snapshot, char *level, size_t level_size, int *levels_cleared) {
+    int fd = open(snapshot->path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    char *file = NULL;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(file_header_t)) {
+        file = malloc(st.st_size);
+        if (read(fd, file, st.st_size) != st.st_size) {
+            free(file);
+            file = NULL;
+        }
+    }
+    close(fd);
+    if (!file) return -1;
+
+    file_header_t *header = (file_header_t*) file;
+    size_t size = header->slot_size;
+    const char *best = NULL;
+    uint64_t best_seq = 0;
+
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 4) == 0 && size >= sizeof(slot_header_t) &&
+        (size_t) st.st_size >= sizeof(file_header_t) + 2 * size) {
+        for (int i = 0; i < 2; i++) {
+            const char *slot = file + sizeof(file_header_t) + i * size;
+            slot_header_t *saved = (slot_header_t*) slot;
+            uint64_t seq = atomic_load(&saved->seq);
+            // a slot cut short by a crash still has seq 0 or a bad checksum
+            if (seq == 0 || seq <= best_seq || saved->checksum != checksum(slot, size)) continue;
+            if (saved->width <= 0 || saved->height <= 0 || saved->n_pacmans < 0 || saved->n_ghosts < 0 ||
+                slot_size(saved->width, saved->height, saved->n_pacmans, saved->n_ghosts) != size) continue;
+            best = slot;
+            best_seq = seq;
+        }
+    }
+
+    if (!best) {
+        free(file);
+        return -1;
+    }
+
+    // only the newest slot is kept for snapshot_restore
+    slot_header_t *saved = (slot_header_t*) best;
+    snapshot->pending = malloc(size);
+    memcpy(snapshot->pending, best, size);
+    snprintf(level, level_size, "%s", saved->level);
+    *levels_cleared = saved->levels_cleared;
+    free(file);
+    return 0;
+}
+
+int snapshot_restore(snapshot_t *snapshot, board_t *board) {
+    slot_header_t *saved = (slot_header_t*) snapshot->pending;
+    if (!saved) return -1;
+
+    int result = -1;
+    if (saved->width == board->width && saved->height == board->height &&
+        saved->n_pacmans == board->n_pacmans && saved->n_ghosts == board->n_ghosts) {
+        const char *data = snapshot->pending + sizeof(slot_header_t);
+        size_t cells = board->width * board->height * sizeof(board_pos_t);
+        memcpy(board->board, data, cells);
+        // the saved script pointers belong to the process that wrote the file
+        const script_t *pacman_script = board->pacmans[0].script;
+        const script_t *ghost_scripts[MAX_GHOSTS];
+        for (int i = 0; i < board->n_ghosts; i++) ghost_scripts[i] = board->ghosts[i].script;
+        memcpy(board->pacmans, data + cells, board->n_pacmans * sizeof(pacman_t));
+        memcpy(board->ghosts, data + cells + board->n_pacmans * sizeof(pacman_t), board->n_ghosts * sizeof(ghost_t));
+        board->pacmans[0].script = pacman_script;
+        for (int i = 0; i < board->n_ghosts; i++) board->ghosts[i].script = ghost_scripts[i];
+        result = 0;
+    }
+
+    free(snapshot->pending);
+    snapshot->pending = NULL;
+    return result;
+}
+
+static void write_slot(snapshot_t *snapshot, board_t *board, uint64_t seq) {
+    char *slot = slot_at(snapshot, seq);
+    size_t size = ((file_header_t*) snapshot->map)->slot_size;
+    slot_header_t *header = (slot_header_t*) slot;
+
+    atomic_store_explicit(&header->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    header->levels_cleared = snapshot->levels_cleared;
+    header->width = board->width;
+    header->height = board->height;
+    header->n_pacmans = board->n_pacmans;
+    header->n_ghosts = board->n_ghosts;
+    memcpy(header->level, board->level_name, sizeof(header->level));
+
+    char *data = slot + sizeof(slot_header_t);
+    size_t cells = board->width * board->height * sizeof(board_pos_t);
+    memcpy(data, board->board, cells);
+    memcpy(data + cells, board->pacmans, board->n_pacmans * sizeof(pacman_t));
+    memcpy(data + cells + board->n_pacmans * sizeof(pacman_t), board->ghosts, board->n_ghosts * sizeof(ghost_t));
+
+    header->checksum = checksum(slot, size);
+    // the slot only counts once everything above is in place
+    atomic_store_explicit(&header->seq, seq, memory_order_release);
+}
+
+int snapshot_begin_level(snapshot_t *snapshot, board_t *board, int levels_cleared) {
+    size_t size = slot_size(board->width, board->height, board->n_pacmans, board->n_ghosts);
+    size_t file_size = sizeof(file_header_t) + 2 * size;
+
+    // the layout depends on the level, build the new file aside and rename it over the old one
+    char tmp[MAX_FILENAME + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", snapshot->path);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, file_size) != 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    char *map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        unlink(tmp);
+        return -1;
+    }
+
+    if (snapshot->map) munmap(snapshot->map, snapshot->size);
+    snapshot->map = map;
+    snapshot->size = file_size;
+    snapshot->seq = 0;
+    snapshot->levels_cleared = levels_cleared;
+
+    file_header_t *header = (file_header_t*) map;
+    memcpy(header->magic, SNAPSHOT_MAGIC, 4);
+    header->slot_size = size;
+    snapshot_save(snapshot, board);
+
+    if (rename(tmp, snapshot->path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void snapshot_save(snapshot_t *snapshot, board_t *board) {
+    // pages of a shared mapping outlive the process, no msync on the tick path
+    if (snapshot->map) write_slot(snapshot, board, ++snapshot->seq);
+}
+
+void snapshot_close(snapshot_t *snapshot, int discard) {
+    if (!snapshot) return;
+    if (snapshot->map) munmap(snapshot->map, snapshot->size);
+    if (discard) unlink(snapshot->path);
+    free(snapshot->pending);
+    free(snapshot);
+}
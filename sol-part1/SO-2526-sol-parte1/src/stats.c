@@ -0,0 +1,74 @@
+#include "stats.h"
+#include <stdatomic.h>
+
+#define STAT_STRIPES 64
+
+typedef struct {
+    _Alignas(64) atomic_uint_fast64_t values[STAT_COUNT];
+} stat_stripe_t;
+
+static stat_stripe_t stripes[STAT_STRIPES];
+static atomic_uint next_stripe = 0;
+static _Thread_local int my_stripe = -1;
+
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} stat_info[STAT_COUNT] = {
+    [STAT_SESSIONS_STARTED] = {"pacman_sessions_started_total", "counter", "Game sessions started"},
+    [STAT_SESSIONS_ENDED] = {"pacman_sessions_ended_total", "counter", "Game sessions finished"},
+    [STAT_SESSIONS_QUEUED] = {"pacman_sessions_queued_total", "counter", "Sessions put in session_buffer"},
+    [STAT_SESSIONS_DEQUEUED] = {"pacman_sessions_dequeued_total", "counter", "Sessions taken from session_buffer"},
+    [STAT_FRAMES_SENT] = {"pacman_frames_sent_total", "counter", "Board frames written to players"},
+    [STAT_BYTES_WRITTEN] = {"pacman_bytes_written_total", "counter", "Frame bytes written to players and spectators"},
+    [STAT_COMMANDS_RECEIVED] = {"pacman_commands_received_total", "counter", "OP_CODE_PLAY commands read"},
+    [STAT_PACMAN_TICKS] = {"pacman_pacman_ticks_total", "counter", "Pacman moves executed"},
+    [STAT_GHOST_TICKS] = {"pacman_ghost_ticks_total", "counter", "Ghost moves executed"},
+    [STAT_SLOT_WAITS] = {"pacman_slot_waits_total", "counter", "Waits on max_sessions_sem"},
+    [STAT_SLOT_WAIT_NS] = {"pacman_slot_wait_ns_total", "counter", "Nanoseconds spent waiting on max_sessions_sem"},
+    [STAT_LEVEL_LOADS] = {"pacman_level_loads_total", "counter", "Levels loaded"},
+    [STAT_SESSIONS_RESUMED] = {"pacman_sessions_resumed_total", "counter", "Sessions resumed from a crash snapshot"},
+    [STAT_LEVEL_INDEX_RELOADS] = {"pacman_level_index_reloads_total", "counter", "Level index rebuilds after a change in the level directory"},
+    [STAT_ENTITY_THREADS_SPAWNED] = {"pacman_entity_threads_spawned_total", "counter", "Pacman, ghost and update threads created, they are kept across levels and sessions"},
+    [STAT_CHECKPOINT_RESTORES] = {"pacman_checkpoint_restores_total", "counter", "Deaths rolled back to the checkpoint a G saved"},
+};
+
+void stats_add(stat_t stat, uint64_t value) {
+    if (my_stripe < 0) {
+        my_stripe = atomic_fetch_add_explicit(&next_stripe, 1, memory_order_relaxed) % STAT_STRIPES;
+    }
+    atomic_fetch_add_explicit(&stripes[my_stripe].values[stat], value, memory_order_relaxed);
+}
+
+uint64_t stats_get(stat_t stat) {
+    uint64_t total = 0;
+    for (int i = 0; i < STAT_STRIPES; i++) {
+        total += atomic_load_explicit(&stripes[i].values[stat], memory_order_relaxed);
+    }
+    return total;
+}
+
+// counters are summed one after the other, never report a negative gauge
+static unsigned long long gauge(uint64_t in, uint64_t out) {
+    return in > out ? in - out : 0;
+}
+
+void stats_write(FILE *out) {
+    uint64_t totals[STAT_COUNT];
+    for (int stat = 0; stat < STAT_COUNT; stat++) {
+        totals[stat] = stats_get(stat);
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+                stat_info[stat].name, stat_info[stat].help,
+                stat_info[stat].name, stat_info[stat].type,
+                stat_info[stat].name, (unsigned long long) totals[stat]);
+    }
+
+    // the gauges fall out of the counters
+    fprintf(out, "# HELP pacman_sessions_active Sessions currently playing\n"
+                 "# TYPE pacman_sessions_active gauge\npacman_sessions_active %llu\n",
+            gauge(totals[STAT_SESSIONS_STARTED], totals[STAT_SESSIONS_ENDED]));
+    fprintf(out, "# HELP pacman_sessions_waiting Sessions waiting in session_buffer\n"
+                 "# TYPE pacman_sessions_waiting gauge\npacman_sessions_waiting %llu\n",
+            gauge(totals[STAT_SESSIONS_QUEUED], totals[STAT_SESSIONS_DEQUEUED]));
+}
@@ -0,0 +1,170 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+// Each thread appends to its own chunk, chunks are only linked under chunks_mutex.
+// Chunks are never freed, TRACE_MAX_CHUNKS bounds the memory used (about 75MB).
+// Chunks are kept small so threads that trace little (preload, idle ghosts) don't each pin a big one.
+#define TRACE_CHUNK_EVENTS 256
+#define TRACE_MAX_CHUNKS 4096
+#define TRACE_NAME_LENGTH 32
+
+typedef struct {
+    const char *name; // string literal
+    char session[TRACE_TAG_LENGTH];
+    uint64_t start_ns;
+    uint64_t duration_ns;
+} trace_event_t;
+
+typedef struct trace_chunk {
+    struct trace_chunk *next;
+    int tid;
+    int first; // first chunk of its thread, carries the thread name
+    char thread_name[TRACE_NAME_LENGTH];
+    atomic_int count;
+    trace_event_t events[TRACE_CHUNK_EVENTS];
+} trace_chunk_t;
+
+int trace_enabled = 0;
+static char *trace_path = NULL;
+
+static trace_chunk_t *chunks = NULL;
+static int n_chunks = 0;
+static pthread_mutex_t chunks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint_fast64_t dropped = 0;
+static atomic_int next_tid = 1;
+
+static _Thread_local trace_chunk_t *my_chunk = NULL;
+static _Thread_local int my_tid = 0;
+static _Thread_local char my_name[TRACE_NAME_LENGTH] = "thread";
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_init() {
+    trace_path = getenv("PACMAN_TRACE");
+    if (!trace_path || trace_path[0] == '\0') return;
+    trace_enabled = 1;
+    atexit(trace_flush);
+}
+
+void trace_thread_name(const char *name) {
+    if (!trace_enabled) return;
+    snprintf(my_name, sizeof(my_name), "%s", name);
+}
+
+uint64_t trace_begin() {
+    return trace_enabled ? now_ns() : 0;
+}
+
+static trace_chunk_t* new_chunk() {
+    pthread_mutex_lock(&chunks_mutex);
+    if (n_chunks == TRACE_MAX_CHUNKS) {
+        pthread_mutex_unlock(&chunks_mutex);
+        return NULL;
+    }
+    n_chunks++;
+    pthread_mutex_unlock(&chunks_mutex);
+
+    trace_chunk_t *chunk = calloc(1, sizeof(trace_chunk_t));
+    if (!chunk) return NULL;
+    if (!my_tid) my_tid = atomic_fetch_add(&next_tid, 1);
+    chunk->tid = my_tid;
+    chunk->first = (my_chunk == NULL);
+    memcpy(chunk->thread_name, my_name, sizeof(my_name));
+    atomic_init(&chunk->count, 0);
+
+    pthread_mutex_lock(&chunks_mutex);
+    chunk->next = chunks;
+    chunks = chunk;
+    pthread_mutex_unlock(&chunks_mutex);
+    return chunk;
+}
+
+void trace_end(const char *name, const char *session, uint64_t start) {
+    if (!start) return;
+    uint64_t end = now_ns();
+
+    trace_chunk_t *chunk = my_chunk;
+    if (!chunk || atomic_load_explicit(&chunk->count, memory_order_relaxed) == TRACE_CHUNK_EVENTS) {
+        chunk = new_chunk();
+        if (!chunk) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        my_chunk = chunk;
+    }
+
+    int n = atomic_load_explicit(&chunk->count, memory_order_relaxed);
+    trace_event_t *event = &chunk->events[n];
+    event->name = name;
+    snprintf(event->session, sizeof(event->session), "%s", session ? session : "");
+    event->start_ns = start;
+    event->duration_ns = end - start;
+    // publish the event to trace_flush
+    atomic_store_explicit(&chunk->count, n + 1, memory_order_release);
+}
+
+// Session ids come from client chosen pipe names, anything can be in them
+static void write_json_string(FILE *fp, const char *text) {
+    fputc('"', fp);
+    for (const unsigned char *c = (const unsigned char*) text; *c; c++) {
+        if (*c == '"' || *c == '\\') fprintf(fp, "\\%c", *c);
+        else if (*c < 0x20) fprintf(fp, "\\u%04x", *c);
+        else fputc(*c, fp);
+    }
+    fputc('"', fp);
+}
+
+void trace_flush() {
+    if (!trace_enabled) return;
+
+    pthread_mutex_lock(&flush_mutex);
+    FILE *fp = fopen(trace_path, "w");
+    if (!fp) {
+        pthread_mutex_unlock(&flush_mutex);
+        return;
+    }
+
+    pthread_mutex_lock(&chunks_mutex);
+    trace_chunk_t *head = chunks;
+    pthread_mutex_unlock(&chunks_mutex);
+
+    int pid = getpid();
+    const char *sep = "";
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (trace_chunk_t *chunk = head; chunk; chunk = chunk->next) {
+        if (chunk->first) {
+            fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                    sep, pid, chunk->tid);
+            write_json_string(fp, chunk->thread_name);
+            fprintf(fp, "}}");
+            sep = ",\n";
+        }
+        int count = atomic_load_explicit(&chunk->count, memory_order_acquire);
+        for (int i = 0; i < count; i++) {
+            trace_event_t *event = &chunk->events[i];
+            fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"pacman\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":%d,\"tid\":%d,\"args\":{\"session\":",
+                    sep, event->name, event->start_ns / 1000.0, event->duration_ns / 1000.0,
+                    pid, chunk->tid);
+            write_json_string(fp, event->session);
+            fprintf(fp, "}}");
+            sep = ",\n";
+        }
+    }
+    fprintf(fp, "\n],\"otherData\":{\"dropped_events\":%llu}}\n",
+            (unsigned long long) atomic_load(&dropped));
+
+    fclose(fp);
+    pthread_mutex_unlock(&flush_mutex);
+}
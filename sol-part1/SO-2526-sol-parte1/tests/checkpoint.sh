@@ -0,0 +1,16 @@
+#!/bin/sh
+# A client that saves with G and is then caught by the ghost goes back to the
+# checkpoint instead of losing, about once per session
+. "$(dirname "$0")/lib.sh"
+
+# the client sends G and then waits, the ghost walks into it after five ticks
+start_server "$TESTS/levels/checkpoint" 1
+loadgen -n 1 -d 4 -m "$TESTS/levels/checkpoint.p"
+
+wait_for 5 '[ "$(stat pacman_sessions_ended_total)" = "$(stat pacman_sessions_started_total)" ]' ||
+    fail "sessions did not end with the client"
+ended=$(stat pacman_sessions_ended_total)
+restores=$(stat pacman_checkpoint_restores_total)
+[ "$ended" -ge 2 ] || fail "only $ended sessions in 4s"
+[ $((restores * 2)) -ge "$ended" ] || fail "$restores restores for $ended sessions"
+pass
@@ -0,0 +1,15 @@
+#!/bin/sh
+# A session worker keeps its pacman, ghost and update threads across levels
+# and sessions: hundreds of level loads, a handful of threads
+. "$(dirname "$0")/lib.sh"
+
+# four 6x6 levels the scripted pacman clears in three moves, one ghost each
+start_server "$TESTS/levels/crew" 2
+loadgen -n 2 -d 3 -m "$TESTS/levels/wait.p"
+
+loads=$(stat pacman_level_loads_total)
+spawned=$(stat pacman_entity_threads_spawned_total)
+[ "$loads" -ge 20 ] || fail "only $loads level loads in 3s"
+# a pacman, a ghost and an update thread for each of the two workers
+[ "$spawned" -le 6 ] || fail "$spawned entity threads for $loads level loads"
+pass
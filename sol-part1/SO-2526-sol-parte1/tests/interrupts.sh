@@ -0,0 +1,13 @@
+#!/bin/sh
+# A round that ends wakes the ghosts and the update thread at once, a ghost
+# sleeping through a 10s move doesn't hold up the next level
+. "$(dirname "$0")/lib.sh"
+
+# the pacman clears each level in three 50ms moves, the ghost moves every 201 ticks
+start_server "$TESTS/levels/interrupts" 1
+loadgen -n 1 -d 3 -m "$TESTS/levels/wait.p"
+
+ended=$(stat pacman_sessions_ended_total)
+# two levels a session, without the interrupt the first one alone would take 10s
+[ "$ended" -ge 3 ] || fail "only $ended sessions in 3s"
+pass
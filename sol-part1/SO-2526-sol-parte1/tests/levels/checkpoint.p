@@ -0,0 +1,11 @@
+G
+T
+T
+T
+T
+T
+T
+T
+T
+T
+T
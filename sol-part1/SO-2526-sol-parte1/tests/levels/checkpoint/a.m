@@ -0,0 +1,9 @@
+PASSO 0
+POS 4 1
+T 5
+A
+A
+A
+D
+D
+D
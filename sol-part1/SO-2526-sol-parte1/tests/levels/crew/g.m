@@ -0,0 +1,3 @@
+PASSO 0
+POS 1 4
+T 100
@@ -0,0 +1,3 @@
+PASSO 200
+POS 1 4
+W
@@ -0,0 +1,5 @@
+PASSO 0
+POS 1 1
+D
+D
+D
@@ -0,0 +1,3 @@
+PASSO 0
+POS 8 8
+T 100
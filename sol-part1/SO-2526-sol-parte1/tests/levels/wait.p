@@ -0,0 +1 @@
+T
@@ -0,0 +1,61 @@
+# Sourced by every check in tests/. A check runs the server in a scratch
+# directory, drives it with the client tree's loadgen and asserts on what
+# comes back: the counters on <fifo>.stats or the bytes a pipe received.
+
+TESTS=$(cd "$(dirname "$0")" && pwd)
+NAME=$(basename "$0" .sh)
+# absolute, the server runs from the scratch directory
+SERVER=$(cd "$(dirname "${SERVER:-bin/Pacmanist}")" && pwd)/$(basename "${SERVER:-bin/Pacmanist}")
+LOADGEN=$(cd "$(dirname "${LOADGEN:-../../client-base/client-base-with-Makefile-v3/bin/loadgen}")" 2>/dev/null && pwd)/loadgen
+
+WORK=$(mktemp -d /tmp/pacman-check.XXXXXX)
+REG=$WORK/reg
+SERVER_PID=
+
+cleanup() {
+    if [ -n "$SERVER_PID" ]; then kill -9 "$SERVER_PID" 2>/dev/null; fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL $NAME: $*"
+    exit 1
+}
+
+pass() {
+    echo "ok   $NAME"
+    exit 0
+}
+
+# start_server <level_dir> <max_games>, PACMAN_* variables set by the caller pass through
+start_server() {
+    (cd "$WORK" && exec "$SERVER" "$1" "$2" "$REG" >server.out 2>&1) &
+    SERVER_PID=$!
+    for _ in $(seq 50); do
+        if [ -p "$REG" ] && [ -p "$REG.stats" ]; then return 0; fi
+        sleep 0.1
+    done
+    fail "the server did not start"
+}
+
+# stat <counter>, its current value on the stats fifo
+stat() {
+    timeout 5 cat "$REG.stats" | awk -v name="$1" '$1 == name { print $2 }'
+}
+
+# loadgen <loadgen args>, blocks until it is done, the report lands in $WORK/loadgen.json.
+# A client stuck connecting to a broken server would keep it going, so it gets 30s
+loadgen() {
+    (cd "$WORK" && exec timeout 30 "$LOADGEN" -r "$REG" -o "$WORK/loadgen.json" "$@") >"$WORK/loadgen.out" 2>&1
+}
+
+# wait_for <seconds> <shell condition>
+wait_for() {
+    deadline=$(( $(date +%s) + $1 ))
+    while ! eval "$2"; do
+        [ "$(date +%s)" -ge "$deadline" ] && return 1
+        sleep 0.1
+    done
+    return 0
+}
@@ -0,0 +1,21 @@
+#!/bin/sh
+# With PACMAN_ROOM_SIZE=2 one worker plays two clients on the same board,
+# both at once, instead of queueing the second one behind the first
+. "$(dirname "$0")/lib.sh"
+
+# the pacmans wait and the ghost stands still, the session lasts as long as the clients
+PACMAN_ROOM_SIZE=2 PACMAN_ROOM_WAIT_MS=2000 start_server "$TESTS/levels/rooms" 1
+loadgen -n 2 -d 3 -m "$TESTS/levels/wait.p" &
+LOADGEN_PID=$!
+
+sleep 1.5
+active=$(stat pacman_sessions_active)
+waiting=$(stat pacman_sessions_waiting)
+loads=$(stat pacman_level_loads_total)
+wait "$LOADGEN_PID"
+
+[ "$active" = 2 ] || fail "$active players playing on the one worker"
+[ "$waiting" = 0 ] || fail "$waiting players still queued"
+# both play the level one worker loaded for them
+[ "$loads" = 1 ] || fail "$loads level loads for one room"
+pass
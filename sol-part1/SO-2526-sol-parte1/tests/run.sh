@@ -0,0 +1,17 @@
+#!/bin/sh
+# Runs every check in tests/, make check calls it from the top of the tree
+cd "$(dirname "$0")/.." || exit 1
+
+if [ ! -x "${LOADGEN:-../../client-base/client-base-with-Makefile-v3/bin/loadgen}" ]; then
+    echo "loadgen not found, build it in the client tree (make loadgen) or set LOADGEN"
+    exit 1
+fi
+
+failed=0
+for check in tests/*.sh; do
+    case "$check" in
+        tests/lib.sh|tests/run.sh) continue ;;
+    esac
+    sh "$check" || failed=$((failed + 1))
+done
+[ "$failed" -eq 0 ] || { echo "$failed check(s) failed"; exit 1; }
@@ -0,0 +1,65 @@
+#!/bin/sh
+# A spectator of a 320x320 board (frames of ~100KB, more than a pipe holds)
+# gets only whole frames, read right away or after the pipe sat full
+. "$(dirname "$0")/lib.sh"
+
+SIZE=320
+FRAME=$((1 + 24 + SIZE * SIZE))
+mkdir "$WORK/levels"
+awk -v n=$SIZE 'BEGIN {
+    print "DIM " n " " n; print "TEMPO 10"; print "MON g.m"
+    for (y = 0; y < n; y++) {
+        row = ""
+        for (x = 0; x < n; x++) row = row ((x == 0 || y == 0 || x == n - 1 || y == n - 1) ? "X" : "o")
+        print row
+    }
+}' > "$WORK/levels/1.lvl"
+printf 'PASSO 0\nPOS 300 300\nR\n' > "$WORK/levels/g.m"
+printf 'T\n' > "$WORK/moves"
+
+start_server "$WORK/levels" 1
+(cd "$WORK" && exec "$LOADGEN" -r "$REG" -n 1 -d 3 -m "$WORK/moves" -o "$WORK/loadgen.json" >/dev/null 2>&1) &
+LOADGEN_PID=$!
+wait_for 5 '[ "$(stat pacman_sessions_started_total)" -ge 1 ]' || fail "the player never got a session"
+
+# the 81 byte request in one write, like a client's
+spectate() {
+    {
+        printf '\005%s' "lg$LOADGEN_PID-0"; head -c $((40 - ${#LOADGEN_PID} - 4)) /dev/zero
+        printf '%s' "$1"; head -c $((40 - ${#1})) /dev/zero
+    } > "$WORK/request"
+    cat "$WORK/request" > "$REG"
+}
+
+FAST=/tmp/spec$$f_notification
+SLOW=/tmp/spec$$s_notification
+mkfifo "$FAST" "$SLOW"
+cat "$FAST" > "$WORK/fast.out" &
+FAST_PID=$!
+# opens its end right away, reads nothing for a second
+(sleep 1; cat) < "$SLOW" > "$WORK/slow.out" &
+SLOW_PID=$!
+spectate "$FAST"
+spectate "$SLOW"
+
+# the session ends with loadgen and closes the spectators' pipes
+wait "$LOADGEN_PID"
+wait_for 10 '! kill -0 $FAST_PID 2>/dev/null && ! kill -0 $SLOW_PID 2>/dev/null'
+status=$?
+rm -f "$FAST" "$SLOW"
+[ $status -eq 0 ] || fail "the spectators' pipes were not closed at the end of the session"
+
+for out in fast slow; do
+    bytes=$(wc -c < "$WORK/$out.out")
+    [ "$(od -An -tu1 -N2 "$WORK/$out.out" | tr -s ' ')" = " 5 0" ] || fail "$out spectator was not accepted"
+    frames=$(( (bytes - 2) / FRAME ))
+    [ $(( (bytes - 2) % FRAME )) -eq 0 ] || fail "$out spectator got a torn frame ($bytes bytes)"
+    [ "$frames" -ge 5 ] || fail "$out spectator got $frames frames"
+    i=0
+    while [ $i -lt "$frames" ]; do
+        [ "$(od -An -tu1 -j $((2 + i * FRAME)) -N1 "$WORK/$out.out" | tr -d ' ')" = 4 ] ||
+            fail "$out spectator frame $i does not start with OP_CODE_BOARD"
+        i=$((i + 1))
+    done
+done
+pass